@@ -1,271 +1,199 @@
-#define STB_IMAGE_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-
+#include "to_ascii.h"   // the converter itself, this file is only the command line
 #include <iostream>
-#include "stb_image.h" // the main library for us to read image
-#include "stb_image_write.h"
-#include <libexif/exif-data.h>
 #include <filesystem>
 #include <string>
-#include <vector>
-#include <cmath>
 #include <algorithm>
-#include <fstream>
-
-#define GRAYSCALE 1
+#include <memory>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
 
 using namespace std;
 namespace fs = std::filesystem;
 
-class ToAscii {
-    private:
-        //const string palette = "@%#*+=-:~. ";
-        const string palette = " .~:-=+*#&@";   // Great for black background terminal
-
-        vector <unsigned char> image_data;
-        int width = 0, height = 0;
-        string filename;
-        vector <unsigned char> ascii_form;
-
-        int biggest_common_div(int a, int b) { // it uses Euclidean algorithm and recursion
-            if (a == 0) return b;
-            return biggest_common_div(b % a, a);
-        }
-
-        vector<int> common_divisors(int a, int b) { // it gets the common divisors from BCD
-            int BCD = biggest_common_div(a,b);
-            if (BCD <= 0) return {};
-
-            std::vector<int> factors;
-            int sqrt_n = static_cast<int>(std::sqrt(BCD));
-
-            // Find all factor pairs
-            for (int i = 1; i <= sqrt_n; i++)
-                if (BCD % i == 0) {
-                    factors.push_back(i);           // Add the smaller factor
-                    if (i != BCD / i)
-                        factors.push_back(BCD / i);   // Add the larger factor
+int main(int argc, char* argv[]){
+    PipelineOptions options;
+    unsigned thread_count = 0;
+    string p;
+    string serve_socket, client_socket, png_out;   // server and client modes
+    unsigned repeat = 1;
+    bool stats_only = false;
+    int video_width = 0, video_height = 0, video_channels = 1;   // video mode
+    bool timings = false;
+    unsigned bench_iterations = 0;   // --bench
+    string trace_path;
+
+    string arg;
+    try {   // stoul, stoi and stof throw on values that are not numbers
+        for (int i = 1; i < argc; i++) {
+            arg = argv[i];
+            if ((arg == "-j" || arg == "--threads") && i + 1 < argc)
+                thread_count = stoul(argv[++i]);
+            else if (arg == "--cache")
+                options.cache = true;
+            else if (arg == "--palette" && i + 1 < argc)
+                options.palette = argv[++i];
+            else if (arg == "--scale" && i + 1 < argc)
+                options.grid_scale = stof(argv[++i]);
+            else if (arg == "--cols" && i + 1 < argc)
+                options.columns = stoi(argv[++i]);
+            else if (arg == "--rows" && i + 1 < argc)
+                options.rows = stoi(argv[++i]);
+            else if (arg == "--char-aspect" && i + 1 < argc)
+                options.char_aspect = stof(argv[++i]);
+            else if (arg == "--serve" && i + 1 < argc)
+                serve_socket = argv[++i];
+            else if (arg == "--client" && i + 1 < argc)
+                client_socket = argv[++i];
+            else if (arg == "--png-out" && i + 1 < argc)
+                png_out = argv[++i];
+            else if (arg == "--repeat" && i + 1 < argc)
+                repeat = stoul(argv[++i]);
+            else if (arg == "--stats")
+                stats_only = true;
+            else if (arg == "--animate")
+                options.animate = true;
+            else if (arg == "--color" && i + 1 < argc) {
+                string mode(argv[++i]);
+                if (mode == "off") options.color = ColorMode::Off;
+                else if (mode == "24bit") options.color = ColorMode::TrueColor;
+                else if (mode == "256") options.color = ColorMode::Palette256;
+                else {
+                    cerr << "Unknown color mode: " << mode << endl;
+                    return 1;
                 }
-            std::sort(factors.begin(), factors.end());
-            return factors;
-        }
-
-        int get_index(int row, int col) {
-            return row * width + col;
-        }
-
-        // Functions regarding orientation problem
-        void rotate90CW() { 
-            vector<unsigned char> rotated(width * height);
-            for (int r = 0; r < height; r++)
-                for (int c = 0; c < width; c++)
-                    rotated[c * height + (height - 1 - r)] = image_data[r * width + c];
-
-            image_data.swap(rotated);
-            swap(width, height);
-        }
-
-        void rotate180() {
-            vector<unsigned char> rotated(width * height);
-            for (int r = 0; r < height; r++)
-                for (int c = 0; c < width; c++) 
-                    rotated[(height - 1 - r) * width + (width - 1 - c)] = image_data[r * width + c];
-
-            image_data.swap(rotated);
-        }
-
-        void rotate90CCW() {
-            vector<unsigned char> rotated(width * height);
-            for (int r = 0; r < height; r++)
-                for (int c = 0; c < width; c++)
-                    rotated[(width - 1 - c) * height + r] = image_data[r * width + c];
-
-            image_data.swap(rotated);
-            swap(width, height);
-        }
-
-        int get_exif_orientation(const char* img_path) {
-            ExifData* exifData = exif_data_new_from_file(img_path);
-            if (!exifData) 
-                return 0; // No EXIF data found
-            
-            int orientation = -1;
-            ExifByteOrder byteOrder = exif_data_get_byte_order(exifData);
-            ExifEntry* entry = exif_data_get_entry(exifData, EXIF_TAG_ORIENTATION);
-            
-            if (entry) 
-                orientation = exif_get_short(entry->data, byteOrder);
-            
-            exif_data_free(exifData);
-            return orientation;
-        }
-
-        void fix_orientation(const char* img_path) {
-            int orientation = get_exif_orientation(img_path);
-            switch(orientation){
-                case 1: // normal
-                    break;
-                case 3: // rotated 180
-                    rotate180();
-                    break;
-                case 6:
-                    rotate90CW();
-                    break;
-                case 8:
-                    rotate90CCW();
-                    break;
-                default:
-                    break;
             }
-
-        }
-
-        // MAIN FUNCTIONS
-        void load_image(const string& img_path, int &img_width, int &img_height, int &channels, int desired_channel = GRAYSCALE){
-            unsigned char* data = stbi_load(img_path.c_str(), &img_width, &img_height, &channels, desired_channel);
-            width = img_width;
-            height = img_height;
-
-            if (!data)  throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
-            
-            size_t image_size = width * height * GRAYSCALE;
-            image_data.assign(data, data + image_size);
-
-            int orientation = get_exif_orientation(img_path.c_str());
-            if (orientation == 3 || orientation == 6 || orientation == 8)
-                fix_orientation(img_path.c_str());
-
-            // assign filename except first 5 and last 4 chars, for test/ and .jpg
-            if (img_path.size() > 9)// avoid out of range
-                filename = img_path.substr(5, img_path.size() - 5 - 4);
-            else
-                filename = img_path; // fallback
-
-            stbi_image_free(data);
-        }
-
-        bool save_image_as_png() {
-            string return_name = "out/" + filename + ".png";
-            return stbi_write_png(return_name.c_str(), width, height, 1, image_data.data(), width) != 0;
-        }
-
-        // this resize used common factors, not so great
-        void resize_image(const int resize_factor) {  // resize factor is the next smallest common divisor between w and h. 1 is directly 1.
-            vector<int> possible_divisors = common_divisors(width, height);
-            int divisor;
-            if (resize_factor <= 0) divisor = 1;
-            else if (possible_divisors.size() <= resize_factor) divisor = possible_divisors[possible_divisors.size()-1];
-            else divisor = possible_divisors[resize_factor];
-
-            // at this point, we know the divisor. Need to group ant take the average value.
-            vector<unsigned char> resized_image_data(image_data.size() / (divisor*divisor));
-            int index = 0;
-
-            for (int row_p = 0; row_p < height; row_p = row_p + divisor)
-                for (int col_p = 0; col_p < width; col_p = col_p + divisor) {  // we use 2d addressing on a 1d array. Moving the pointer
-                    int sum = 0;
-                    for (int i = 0; i < divisor; i++)
-                        for (int j = 0; j < divisor; j++)
-                            sum += image_data[(row_p+i)*width + (col_p+j)];
-
-                    unsigned char avg = sum / (divisor*divisor);
-                    resized_image_data[index++] = avg;
+            else if (arg == "--glyphs" && i + 1 < argc) {
+                string mode(argv[++i]);
+                if (mode == "brightness") options.glyph_mode = GlyphMode::Brightness;
+                else if (mode == "structure") options.glyph_mode = GlyphMode::Structure;
+                else if (mode == "quadrant") options.glyph_mode = GlyphMode::Quadrant;
+                else if (mode == "braille") options.glyph_mode = GlyphMode::Braille;
+                else {
+                    cerr << "Unknown glyph mode: " << mode << endl;
+                    return 1;
                 }
-
-            image_data.clear();
-            image_data = resized_image_data;
-            width = width / divisor;
-            height = height / divisor;
-        }
-
-        // new resize, uses nearest neighbour
-        void resize_image_nearest(float scale_x, float scale_y) {
-            int new_width = static_cast<int>(width * scale_x);
-            int new_height = static_cast<int>(height * scale_y);
-
-            // so that minimum size of 1x1 is guaranteed
-            new_width = max(new_width, 1);
-            new_height = max(new_height, 1);
-
-            vector<unsigned char> resized_image_data(new_width * new_height);
-
-            for (int row = 0; row < new_height; row++)
-                for (int col = 0; col < new_width; col++) {
-                    float orig_x = (col + 0.5f) / scale_x;  // +0.5 for center sampling
-                    float orig_y = (row + 0.5f) / scale_y;
-
-                    // Convert to integer coordinates
-                    int orig_x_int = static_cast<int>(orig_x);
-                    int orig_y_int = static_cast<int>(orig_y);
-
-                    orig_x_int = clamp(orig_x_int, 0, width - 1);
-                    orig_y_int = clamp(orig_y_int, 0, height - 1);
-
-                    resized_image_data[row * new_width + col] = image_data[orig_y_int * width + orig_x_int];
+            }
+            else if (arg == "--dither" && i + 1 < argc) {
+                const char* names[] = {"off", "floyd", "atkinson", "bayer"};
+                auto name = find(begin(names), end(names), string(argv[++i]));
+                if (name == end(names)) {
+                    cerr << "Unknown dither mode: " << argv[i] << endl;
+                    return 1;
+                }
+                options.dither = static_cast<DitherMode>(name - begin(names));
+            }
+            else if (arg == "--video" && i + 1 < argc) {
+                if (sscanf(argv[++i], "%dx%d", &video_width, &video_height) != 2 || video_width <= 0 || video_height <= 0) {
+                    cerr << "Expected the video size as WIDTHxHEIGHT: " << argv[i] << endl;
+                    return 1;
+                }
+            }
+            else if (arg == "--pixel" && i + 1 < argc) {
+                string format(argv[++i]);
+                if (format == "gray8") video_channels = 1;
+                else if (format == "rgb24") video_channels = 3;
+                else {
+                    cerr << "Unknown pixel format: " << format << endl;
+                    return 1;
+                }
+            }
+            else if (arg == "--timings")
+                timings = true;
+            else if (arg == "--trace" && i + 1 < argc)
+                trace_path = argv[++i];
+            else if (arg == "--bench")
+                bench_iterations = max(bench_iterations, 5u);
+            else if (arg == "--bench-iterations" && i + 1 < argc) {
+                bench_iterations = stoul(argv[++i]);
+                if (bench_iterations == 0) {
+                    cerr << "The benchmark needs at least one iteration" << endl;
+                    return 1;
+                }
+            }
+            else if (arg == "--png-backend" && i + 1 < argc) {
+                const char* names[] = {"builtin", "store", "fast", "zlib", "libdeflate"};
+                auto name = find(begin(names), end(names), string(argv[++i]));
+                if (name == end(names)) {
+                    cerr << "Unknown png backend: " << argv[i] << endl;
+                    return 1;
+                }
+                options.png_backend = static_cast<PngBackend>(name - begin(names));
+            }
+            else if (arg == "--png" && i + 1 < argc) {
+                string mode(argv[++i]);
+                if (mode == "off") options.png = PngMode::Off;
+                else if (mode == "sync") options.png = PngMode::Sync;
+                else if (mode == "async") options.png = PngMode::Async;
+                else {
+                    cerr << "Unknown png mode: " << mode << endl;
+                    return 1;
                 }
-
-            image_data.clear();
-            image_data = resized_image_data;
-            width = new_width;
-            height = new_height;
-        }
-
-        void img_to_ascii(string ascii_palette) {
-            double multiplier = 256 / ascii_palette.size();
-            ascii_form.resize(width * height);
-
-            for (int i = 0; i < image_data.size(); i++)
-                ascii_form[i] = ascii_palette[round(image_data[i] / multiplier)];
-        }
-
-        void save_image_as_textf() {
-            img_to_ascii(palette);
-            ofstream out_file("ascii/" + filename);
-            for (int i = 0; i < width * height; i++) {
-                out_file << ascii_form[i];
-                if (i % width == width - 1) out_file << endl;
             }
-            out_file.close();
-
-        }
-
-    public:
-        // orientation so we pick resizing ratio
-        void ascii_pipeline(string img_path){
-            int width, height, channels;
-            load_image(img_path, width, height, channels);
-
-            if (height > width)
-                resize_image_nearest(0.05, 0.017);   // FOR VERTICAL
             else
-                resize_image_nearest(0.05, 0.024);   // FOR HORIZONTAL
-            
-            save_image_as_png();
-            save_image_as_textf();
-            cout << "Created file: " << filename << endl;;
-        }
-
-        void batch_ascii(string folder_path){
-            cout << "Scanning the folder: " << folder_path << endl; 
-            std::vector<std::string> files;
-                for (const auto& entry : fs::directory_iterator(folder_path)) 
-                    if (entry.is_regular_file()) 
-                        files.push_back(entry.path().string());  
+                p = arg;
+        }
+    } catch (const logic_error&) {
+        cerr << "Expected a number after " << arg << endl;
+        return 1;
+    }
+
+    if (p.empty() && serve_socket.empty() && video_width == 0 && bench_iterations == 0 && !(stats_only && !client_socket.empty())) {
+        cerr << "Usage: " << argv[0] << " [-j threads] [--png off|sync|async]"
+             << " [--png-backend builtin|store|fast|zlib|libdeflate] [--cache] [--palette chars] [--scale factor] [--animate]"
+             << " [--cols n] [--rows n] [--char-aspect ratio] [--glyphs brightness|structure|quadrant|braille]"
+             << " [--dither off|floyd|atkinson|bayer]"
+             << " [--color off|24bit|256] [--trace file.json]"
+             << " <image, folder or - for stdin>" << endl
+             << "       " << argv[0] << " --serve <socket> [-j threads] [--palette chars] [--scale factor] [--cols n] [--rows n]" << endl
+             << "       " << argv[0] << " --client <socket> [--palette chars] [--scale factor] [--png-out file]"
+             << " [--repeat n] <image> | --stats" << endl
+             << "       " << argv[0] << " --video <width>x<height> [--pixel gray8|rgb24] [--color off|24bit|256 with rgb24] [--timings] [--palette chars] [--scale factor]"
+             << "  (raw frames on stdin)" << endl
+             << "       " << argv[0] << " --bench [--bench-iterations n] [--color off|24bit|256] [--png-backend name]"
+             << "  (JSON on stdout)" << endl
+             << "With --animate a GIF becomes text frames only, --png applies to the other images" << endl;
+        return 1;
+    }
+
+    options.frame_threads = thread_count;   // a single animation gets every thread, see batch_ascii
+    unique_ptr<Tracer> tracer;
+    if (!trace_path.empty()) {
+        tracer = make_unique<Tracer>();
+        options.tracer = tracer.get();
+    }
+
+    try {
+        set_png_backend(options.png_backend);
+        ToAscii engine(options);   // checks palette and scale before any mode starts
+
+        if (bench_iterations > 0)
+            engine.benchmark(bench_iterations);
+
+        else if (video_width > 0)
+            engine.video_pipeline(STDIN_FILENO, STDOUT_FILENO, video_width, video_height, video_channels, timings);
+
+        else if (!serve_socket.empty())
+            run_server(serve_socket, options, thread_count);
+
+        else if (!client_socket.empty())
+            run_client(client_socket, p, options, png_out, repeat, stats_only);
+
+        else if (p == "-")   // image on stdin, text on stdout
+            engine.stream_pipeline(STDIN_FILENO, STDOUT_FILENO);
+
+        else if (fs::is_directory(p))  // if it has last character /, directory
+            engine.batch_ascii(p, thread_count);
         
-            for (int i = 0; i < files.size(); i++)
-                ascii_pipeline(files[i]); 
-        }
-};
-
-int main(int argc, char* argv[]){
-    ToAscii engine;
-
-    string p(argv[1]);
-    if (fs::is_directory(p))  // if it has last character /, directory
-        engine.batch_ascii(p);
-    
-    else if (fs::is_regular_file(p))
-        engine.ascii_pipeline(p);
+        else if (fs::is_regular_file(p))
+            engine.ascii_pipeline(p);
+
+        if (tracer)
+            tracer->write_chrome_trace(trace_path);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -524,6 +524,11 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// JPEGs loaded on the calling thread are decoded at 1/denom of their size (denom is
+// 1, 2, 4 or 8), each 8x8 block is shrunk while it is inverse transformed. Other
+// formats ignore it. stbi_info still reports the full size.
+STBIDEF void stbi_set_jpeg_scale_denom_thread(int denom);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -1134,6 +1139,19 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_shift_local;
+#else
+static int stbi__jpeg_scale_shift_local;
+#endif
+
+STBIDEF void stbi_set_jpeg_scale_denom_thread(int denom)
+{
+   int shift = 0;
+   while (shift < 3 && (2 << shift) <= denom) ++shift;
+   stbi__jpeg_scale_shift_local = shift;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1993,6 +2011,7 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // blocks are written as (8 >> scale_shift)^2 pixels
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2946,8 +2965,35 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// writes one dequantized block to the component plane, shrunk by the scale shift
+static void stbi__jpeg_emit_block(stbi__jpeg *z, stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_SIMD_ALIGN(stbi_uc, full[64]);
+   int shift = z->scale_shift, bs = 8 >> shift, x, y, i, j;
+   if (shift == 0) {
+      z->idct_block_kernel(out, out_stride, data);
+      return;
+   }
+   if (shift == 3) {
+      // the DC term is 8x the block mean, no transform needed
+      out[0] = stbi__clamp(128 + ((data[0] + 4) >> 3));
+      return;
+   }
+   z->idct_block_kernel(full, 8, data);
+   for (y=0; y < bs; ++y) {
+      for (x=0; x < bs; ++x) {
+         int sum = 0;
+         for (j=0; j < (1 << shift); ++j)
+            for (i=0; i < (1 << shift); ++i)
+               sum += full[((y << shift) + j) * 8 + (x << shift) + i];
+         out[y*out_stride + x] = (stbi_uc) ((sum + (1 << (2*shift-1))) >> (2*shift));
+      }
+   }
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   int bs = 8 >> z->scale_shift;
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
@@ -2964,7 +3010,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_emit_block(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2988,11 +3034,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*bs;
+                        int y2 = (j*z->img_comp[n].v + y)*bs;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        stbi__jpeg_emit_block(z, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
                      }
                   }
                }
@@ -3081,7 +3127,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
       // dequantize and idct the data
-      int i,j,n;
+      int i,j,n, bs = 8 >> z->scale_shift;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
@@ -3089,7 +3135,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_emit_block(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3329,8 +3375,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3340,10 +3386,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // coefficients are kept for every 8x8 block, whatever the output scale
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3873,6 +3919,17 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // the planes were filled at the reduced size, shrink the logical dimensions to match
+   if (z->scale_shift) {
+      int k, round = (1 << z->scale_shift) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale_shift;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_shift;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -4033,6 +4090,7 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    memset(j, 0, sizeof(stbi__jpeg));
    STBI_NOTUSED(ri);
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale_shift_local;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
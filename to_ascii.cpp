@@ -0,0 +1,3413 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_STATIC         // the stb functions stay private to the library, callers may link their own stb
+#define STB_IMAGE_WRITE_STATIC
+#define STBIW_ZLIB_COMPRESS png_deflate   // PNG deflate goes through the selectable backend below
+
+// everything but the public API in to_ascii.h stays inside this file
+#include <cstddef>
+namespace {
+unsigned char* png_deflate(unsigned char* data, int data_len, int* out_len, int quality);
+
+// every decoder, encoder and pipeline buffer comes from the per-thread pool below
+void* pool_alloc(size_t size);
+void* pool_realloc(void* block, size_t size);
+void pool_free(void* block);
+}
+#define STBI_MALLOC(sz)           pool_alloc(sz)
+#define STBI_REALLOC(p, newsz)    pool_realloc(p, newsz)
+#define STBI_FREE(p)              pool_free(p)
+#define STBIW_MALLOC(sz)          pool_alloc(sz)
+#define STBIW_REALLOC(p, newsz)   pool_realloc(p, newsz)
+#define STBIW_FREE(p)             pool_free(p)
+
+#include "to_ascii.h"
+#include <iostream>
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"   // static stb, the parts we do not call
+#include "stb_image.h" // the main library for us to read image
+#include "stb_image_write.h"
+#pragma GCC diagnostic pop
+#ifdef ASCII_WITH_ZLIB          // build with -DASCII_WITH_ZLIB -lz
+#include <zlib.h>
+#endif
+#ifdef ASCII_WITH_LIBDEFLATE    // build with -DASCII_WITH_LIBDEFLATE -ldeflate
+#include <libdeflate.h>
+#endif
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <atomic>
+#include <unordered_map>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__SSE2__) || defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define GRAYSCALE 1
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+
+mutex console_mutex;    // workers share cout/cerr, keep their lines whole
+
+void log_line(ostream& stream, const string& line) {
+    lock_guard<mutex> guard(console_mutex);
+    stream << line << '\n';
+}
+
+// Every worker owns a deque of task indices. It pops its own work from the back,
+// and when it runs dry it steals from the front of the other deques.
+class WorkStealingPool {
+    private:
+        struct WorkQueue {
+            mutex lock;
+            deque<size_t> tasks;
+        };
+        vector<WorkQueue> queues;
+
+        bool pop(unsigned worker, size_t &task) {
+            WorkQueue& own = queues[worker];
+            lock_guard<mutex> guard(own.lock);
+            if (own.tasks.empty()) return false;
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+
+        bool steal(unsigned thief, size_t &task) {
+            for (unsigned i = 1; i < queues.size(); i++) {
+                WorkQueue& victim = queues[(thief + i) % queues.size()];
+                lock_guard<mutex> guard(victim.lock);
+                if (victim.tasks.empty()) continue;
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+            return false;
+        }
+
+    public:
+        explicit WorkStealingPool(unsigned worker_count) : queues(max(worker_count, 1u)) {}
+
+        unsigned size() const { return queues.size(); }
+
+        void push(unsigned worker, size_t task) {
+            WorkQueue& q = queues[worker % queues.size()];
+            lock_guard<mutex> guard(q.lock);
+            q.tasks.push_back(task);
+        }
+
+        // blocks until every pushed task is done. Tasks can not spawn new tasks,
+        // so a worker that finds all deques empty can safely retire.
+        void run(const function<void(unsigned worker, size_t task)>& job) {
+            vector<thread> workers;
+            for (unsigned w = 0; w < queues.size(); w++)
+                workers.emplace_back([this, w, &job]() {
+                    size_t task;
+                    while (pop(w, task) || steal(w, task))
+                        job(w, task);
+                });
+
+            for (auto& t : workers)
+                t.join();
+        }
+};
+
+// Threads that stay alive between calls, for work that is split again on every frame like the
+// dither wavefront. run(job) calls job(t) once for every t < size(), t = 0 on the calling thread,
+// and returns when all of them are done
+class ThreadTeam {
+    private:
+        mutex lock;
+        condition_variable start, done;
+        const function<void(unsigned)>* job = nullptr;
+        uint64_t generation = 0;
+        unsigned running = 0;
+        bool stopping = false;
+        vector<thread> helpers;
+
+        void serve(unsigned t) {
+            uint64_t seen = 0;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                start.wait(guard, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                guard.unlock();
+                (*job)(t);
+                guard.lock();
+                if (--running == 0) done.notify_one();
+            }
+        }
+
+    public:
+        explicit ThreadTeam(unsigned size) {
+            for (unsigned t = 1; t < size; t++)
+                helpers.emplace_back(&ThreadTeam::serve, this, t);
+        }
+        ThreadTeam(const ThreadTeam&) = delete;
+        ThreadTeam& operator=(const ThreadTeam&) = delete;
+
+        ~ThreadTeam() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            start.notify_all();
+            for (auto& t : helpers)
+                t.join();
+        }
+
+        unsigned size() const { return helpers.size() + 1; }
+
+        void run(const function<void(unsigned)>& work) {
+            {
+                lock_guard<mutex> guard(lock);
+                job = &work;
+                running = helpers.size();
+                generation++;
+            }
+            start.notify_all();
+            work(0);
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [this]() { return running == 0; });
+        }
+};
+
+// Per-thread cache of freed buffers. Sizes are rounded up to a power of two and freed
+// blocks wait on a list per size class, so once a worker has seen its biggest image the
+// decoder, the resize, the rotations and the PNG encoder all run on memory it already owns.
+// A 16 byte header in front of each block remembers its class.
+class BufferPool {
+    private:
+        static constexpr int class_count = 48;
+        static constexpr size_t cache_bytes_per_class = 8 << 20;   // bounds what an idle worker keeps
+        struct Header { size_t size_class, unused; };
+
+        vector<void*> free_lists[class_count];
+
+        static thread_local BufferPool* current;   // null once this thread's pool is gone
+
+        static int size_class(size_t size) {
+            int k = 6;   // 64 byte minimum
+            while (((size_t)1 << k) < size + sizeof(Header)) k++;
+            return k;
+        }
+
+    public:
+        static atomic<size_t> heap_allocations, reused_allocations;
+
+        BufferPool() { current = this; }
+        ~BufferPool() {
+            current = nullptr;
+            for (auto& list : free_lists)
+                for (void* block : list) free(block);
+        }
+
+        static BufferPool& local() {
+            static thread_local BufferPool pool;
+            return pool;
+        }
+
+        static void* allocate(size_t size) {
+            int k = size_class(size);
+            BufferPool* pool = current ? current : &local();
+            Header* header;
+            if (k < class_count && !pool->free_lists[k].empty()) {
+                header = static_cast<Header*>(pool->free_lists[k].back());
+                pool->free_lists[k].pop_back();
+                reused_allocations.fetch_add(1, memory_order_relaxed);
+            } else {
+                header = static_cast<Header*>(malloc((size_t)1 << k));
+                if (!header) return nullptr;
+                heap_allocations.fetch_add(1, memory_order_relaxed);
+            }
+            header->size_class = k;
+            return header + 1;
+        }
+
+        static void release(void* block) {
+            if (!block) return;
+            Header* header = static_cast<Header*>(block) - 1;
+            size_t k = header->size_class;
+            // many small blocks (the deflate hash chains) or at least two big ones per class
+            if (current && k < class_count && current->free_lists[k].size() < max<size_t>(2, cache_bytes_per_class >> k))
+                current->free_lists[k].push_back(header);
+            else
+                free(header);
+        }
+
+        static void* reallocate(void* block, size_t size) {
+            if (!block) return allocate(size);
+            Header* header = static_cast<Header*>(block) - 1;
+            size_t capacity = ((size_t)1 << header->size_class) - sizeof(Header);
+            if (size <= capacity) return block;
+
+            void* grown = allocate(size);
+            if (!grown) return nullptr;
+            memcpy(grown, block, capacity);
+            release(block);
+            return grown;
+        }
+};
+
+thread_local BufferPool* BufferPool::current = nullptr;
+atomic<size_t> BufferPool::heap_allocations{0}, BufferPool::reused_allocations{0};
+
+void* pool_alloc(size_t size) { return BufferPool::allocate(size); }
+void* pool_realloc(void* block, size_t size) { return BufferPool::reallocate(block, size); }
+void pool_free(void* block) { BufferPool::release(block); }
+
+// Pool backed pixel storage. stb_image allocates its results from the same pool,
+// so a decoded image can be adopted as is instead of being copied.
+class PixelBuffer {
+    private:
+        unsigned char* pixels = nullptr;
+        size_t length = 0;
+        size_t capacity = 0;
+
+    public:
+        PixelBuffer() = default;
+        explicit PixelBuffer(size_t size) { resize(size); }
+        PixelBuffer(const PixelBuffer&) = delete;
+        PixelBuffer& operator=(const PixelBuffer&) = delete;
+        PixelBuffer(PixelBuffer&& other) noexcept { swap(other); }
+        PixelBuffer& operator=(PixelBuffer&& other) noexcept { swap(other); return *this; }
+        ~PixelBuffer() { pool_free(pixels); }
+
+        // data must come from pool_alloc (or stbi_load*), the buffer frees it later
+        void adopt(unsigned char* data, size_t size) {
+            pool_free(pixels);
+            pixels = data;
+            length = capacity = size;
+        }
+
+        // keeps the old contents up to the new size, never shrinks the allocation
+        void resize(size_t size) {
+            if (size > capacity) {
+                unsigned char* grown = static_cast<unsigned char*>(pool_realloc(pixels, size));
+                if (!grown) throw bad_alloc();
+                pixels = grown;
+                capacity = size;
+            }
+            length = size;
+        }
+
+        void swap(PixelBuffer& other) noexcept {
+            std::swap(pixels, other.pixels);
+            std::swap(length, other.length);
+            std::swap(capacity, other.capacity);
+        }
+
+        void clear() { length = 0; }
+        size_t size() const { return length; }
+        bool empty() const { return length == 0; }
+        unsigned char* data() { return pixels; }
+        const unsigned char* data() const { return pixels; }
+        unsigned char& operator[](size_t i) { return pixels[i]; }
+        const unsigned char& operator[](size_t i) const { return pixels[i]; }
+};
+
+// Read only view of a whole file. The file is mmapped so the decoder reads the page cache
+// directly, files that can not be mapped (pipes, empty files) are read into memory instead.
+class MappedFile {
+    private:
+        void* mapping = MAP_FAILED;
+        size_t length = 0;
+        vector<unsigned char> fallback;
+
+    public:
+        explicit MappedFile(const string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw runtime_error("Failed to open the file given: " + path);
+
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                length = info.st_size;
+                mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) madvise(mapping, length, MADV_SEQUENTIAL);
+            }
+
+            if (mapping == MAP_FAILED) {
+                unsigned char chunk[1 << 16];
+                ssize_t got;
+                while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+                    if (got < 0 && errno == EINTR) continue;
+                    if (got < 0) {
+                        close(fd);
+                        throw runtime_error("Failed to read the file given: " + path);
+                    }
+                    fallback.insert(fallback.end(), chunk, chunk + got);
+                }
+                length = fallback.size();
+            }
+            close(fd);
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { if (mapping != MAP_FAILED) munmap(mapping, length); }
+
+        const unsigned char* data() const {
+            return mapping != MAP_FAILED ? static_cast<const unsigned char*>(mapping) : fallback.data();
+        }
+        size_t size() const { return length; }
+};
+
+// Feeds stb_image from a pipe through its callback interface. The first bytes are read
+// up front so the header can be probed before decoding, then replayed to the decoder.
+class StreamReader {
+    private:
+        int fd;
+        vector<unsigned char> head;
+        size_t replayed = 0;
+        bool at_end = false;
+
+        static int read_cb(void* user, char* data, int size) {
+            StreamReader* reader = static_cast<StreamReader*>(user);
+            int given = 0;
+            if (reader->replayed < reader->head.size()) {
+                given = min<size_t>(size, reader->head.size() - reader->replayed);
+                memcpy(data, reader->head.data() + reader->replayed, given);
+                reader->replayed += given;
+            }
+            while (given < size && !reader->at_end) {
+                ssize_t got = read(reader->fd, data + given, size - given);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) reader->at_end = true;
+                else given += got;
+            }
+            return given;
+        }
+
+        static void skip_cb(void* user, int n) {   // pipes can not seek, read and drop
+            char sink[4096];
+            while (n > 0) {
+                int got = read_cb(user, sink, min<int>(n, sizeof(sink)));
+                if (got <= 0) return;
+                n -= got;
+            }
+        }
+
+        static int eof_cb(void* user) {
+            StreamReader* reader = static_cast<StreamReader*>(user);
+            return reader->replayed >= reader->head.size() && reader->at_end;
+        }
+
+    public:
+        const stbi_io_callbacks callbacks = { read_cb, skip_cb, eof_cb };
+
+        // head_size bytes covers the EXIF block and frame header of ordinary JPEGs
+        StreamReader(int fd, size_t head_size) : fd(fd), head(head_size) {
+            size_t filled = 0;
+            while (filled < head_size && !at_end) {
+                ssize_t got = read(fd, head.data() + filled, head_size - filled);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) at_end = true;
+                else filled += got;
+            }
+            head.resize(filled);
+        }
+
+        const unsigned char* header() const { return head.data(); }
+        size_t header_size() const { return head.size(); }
+};
+
+// Fixed set of frame buffers between a reader thread and the renderer. The reader always
+// owns one slot; when the renderer falls behind, the oldest waiting frame is recycled,
+// so what gets shown is recent and the memory never grows.
+class FrameRing {
+    private:
+        vector<PixelBuffer> slots;
+        size_t frame_bytes;
+        deque<size_t> free_slots, ready;
+        size_t reader_slot = 0;
+        mutex lock;
+        condition_variable has_frame;
+        bool closed = false;
+        uint64_t dropped = 0;
+
+    public:
+        FrameRing(size_t count, size_t frame_bytes) : slots(count), frame_bytes(frame_bytes) {
+            for (size_t i = 0; i < count; i++) {
+                slots[i].resize(frame_bytes);
+                if (i > 0) free_slots.push_back(i);
+            }
+        }
+
+        // reader side: the buffer to fill next, then publish it
+        PixelBuffer& reader_frame() { return slots[reader_slot]; }
+
+        void publish() {
+            lock_guard<mutex> guard(lock);
+            ready.push_back(reader_slot);
+            if (!free_slots.empty()) {
+                reader_slot = free_slots.front();
+                free_slots.pop_front();
+            } else {
+                reader_slot = ready.front();   // the oldest frame nobody has picked up yet
+                ready.pop_front();
+                dropped++;
+            }
+            has_frame.notify_one();
+        }
+
+        void close() {
+            lock_guard<mutex> guard(lock);
+            closed = true;
+            has_frame.notify_all();
+        }
+
+        bool is_closed() {
+            lock_guard<mutex> guard(lock);
+            return closed;
+        }
+
+        // renderer side: false once the ring is closed and drained
+        bool next(size_t& slot) {
+            unique_lock<mutex> guard(lock);
+            has_frame.wait(guard, [this]() { return closed || !ready.empty(); });
+            if (ready.empty()) return false;
+            slot = ready.front();
+            ready.pop_front();
+            return true;
+        }
+
+        PixelBuffer& frame(size_t slot) { return slots[slot]; }
+
+        // the renderer may have swapped the buffer, it is grown back before reuse
+        void release(size_t slot) {
+            slots[slot].resize(frame_bytes);
+            lock_guard<mutex> guard(lock);
+            free_slots.push_back(slot);
+        }
+
+        uint64_t dropped_frames() {
+            lock_guard<mutex> guard(lock);
+            return dropped;
+        }
+};
+
+// Decodes a GIF one frame at a time with the stb_image internals (the implementation is
+// compiled into this file). stbi_load_gif_from_memory keeps every frame at full size,
+// this keeps the canvas and the two frames "restore to previous" can go back to.
+class GifDecoder {
+    private:
+        stbi__context context;
+        stbi__gif gif;
+        PixelBuffer previous, two_back;   // RGBA canvas after the last two frames
+        int frames = 0;
+
+    public:
+        GifDecoder(const unsigned char* data, size_t size) {
+            if (size > INT_MAX) throw runtime_error("The image is too big");
+            memset(&gif, 0, sizeof(gif));
+            stbi__start_mem(&context, data, size);
+            if (!stbi__gif_test(&context)) throw runtime_error("Not a gif");
+        }
+        GifDecoder(const GifDecoder&) = delete;
+        GifDecoder& operator=(const GifDecoder&) = delete;
+        ~GifDecoder() {
+            STBI_FREE(gif.out);
+            STBI_FREE(gif.history);
+            STBI_FREE(gif.background);
+        }
+
+        static bool is_gif(const unsigned char* data, size_t size) {
+            return size >= 6 && memcmp(data, "GIF8", 4) == 0;
+        }
+
+        int width() const { return gif.w; }
+        int height() const { return gif.h; }
+
+        // next frame as gray pixels and its delay, false after the last frame
+        bool next(PixelBuffer& gray, int& delay_ms) {
+            int comp;
+            unsigned char* rgba = stbi__gif_load_next(&context, &gif, &comp, 4, frames >= 2 ? two_back.data() : nullptr);
+            if (rgba == reinterpret_cast<unsigned char*>(&context)) return false;   // end of stream marker
+            if (!rgba) throw runtime_error("Failed to decode gif frame " + to_string(frames) + ": " + stbi_failure_reason());
+
+            size_t pixels = (size_t)gif.w * gif.h;
+            two_back.swap(previous);
+            previous.resize(pixels * 4);
+            memcpy(previous.data(), rgba, pixels * 4);
+
+            gray.resize(pixels);
+            for (size_t i = 0; i < pixels; i++)   // same weights as stbi_load with one channel
+                gray[i] = stbi__compute_y(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2]);
+            delay_ms = gif.delay;
+            frames++;
+            return true;
+        }
+};
+
+// Box filter weights for one axis of an area resize. Output pixel i covers source
+// pixels first[i] .. first[i] + count[i] - 1. A weight is the overlap measured in
+// 1/dst of a source pixel, so the weights of every output pixel add up to src.
+struct AxisWeights {
+    vector<int> first, count;
+    vector<uint32_t> weights;   // flat, output pixel after output pixel
+
+    void build(int src, int dst) {
+        first.resize(dst);
+        count.resize(dst);
+        weights.clear();
+        for (int i = 0; i < dst; i++) {
+            long long lo = (long long)i * src, hi = lo + src;
+            int x0 = lo / dst, x1 = (hi - 1) / dst;
+            first[i] = x0;
+            count[i] = x1 - x0 + 1;
+            for (long long x = x0; x <= x1; x++)
+                weights.push_back(min((x + 1) * dst, hi) - max(x * dst, lo));
+        }
+    }
+};
+
+// acc[x] += row[x] * weight, the vertical half of the area resize. This touches every
+// source pixel, so it is the part worth vectorizing.
+static void accumulate_weighted_row(uint32_t* acc, const unsigned char* row, uint32_t weight, int count) {
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i w = _mm256_set1_epi32(weight);
+    for (; x + 8 <= count; x += 8) {
+        __m256i px = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + x)));
+        __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + x), _mm256_add_epi32(sum, _mm256_mullo_epi32(px, w)));
+    }
+#elif defined(__SSE2__)
+    if (weight <= 0xFFFF) {
+        const __m128i w = _mm_set1_epi16(static_cast<short>(weight));
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= count; x += 16) {
+            __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+            __m128i halves[2] = { _mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero) };
+            for (int h = 0; h < 2; h++) {
+                // 8 bit * 16 bit needs 24 bits, glue the low and high product halves back together
+                __m128i low = _mm_mullo_epi16(halves[h], w);
+                __m128i high = _mm_mulhi_epu16(halves[h], w);
+                __m128i* dst = reinterpret_cast<__m128i*>(acc + x + h * 8);
+                _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), _mm_unpacklo_epi16(low, high)));
+                _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1), _mm_unpackhi_epi16(low, high)));
+            }
+        }
+    }
+#endif
+    for (; x < count; x++)
+        acc[x] += row[x] * weight;
+}
+
+// Brightness to glyph mapping. Value v lands in bin v * size / 256, so every
+// index is inside the palette by construction.
+struct GlyphTable {
+    unsigned char lut[256];
+    unsigned char small[16] = {};   // the palette itself, for the shuffle path
+    int size = 0;
+
+    void build(const string& palette) {
+        size = palette.size();
+        for (int v = 0; v < 256; v++)
+            lut[v] = palette[v * size / 256];
+        for (int i = 0; i < size && i < 16; i++)
+            small[i] = palette[i];
+    }
+
+    // dst[i] = lut[src[i]]. Palettes up to 16 glyphs fit in one register, the bin
+    // index is computed with a multiply and the glyph picked with a byte shuffle.
+    void map(const unsigned char* src, unsigned char* dst, size_t count) const {
+        size_t i = 0;
+#if defined(__AVX2__)
+        if (size <= 16) {
+            const __m256i glyphs = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(small)));
+            const __m256i n = _mm256_set1_epi16(size);
+            const __m256i zero = _mm256_setzero_si256();
+            for (; i + 32 <= count; i += 32) {
+                __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+                // unpack and pack both work per 128 bit lane, so the byte order comes back intact
+                __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(px, zero), n), 8);
+                __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(px, zero), n), 8);
+                __m256i index = _mm256_packus_epi16(lo, hi);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(glyphs, index));
+            }
+        }
+#elif defined(__SSSE3__)
+        if (size <= 16) {
+            const __m128i glyphs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(small));
+            const __m128i n = _mm_set1_epi16(size);
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= count; i += 16) {
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), n), 8);
+                __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), n), 8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(glyphs, _mm_packus_epi16(lo, hi)));
+            }
+        }
+#endif
+        for (; i < count; i++)
+            dst[i] = lut[src[i]];
+    }
+};
+
+// 4x8 ink masks for structure matching, one string per row and '#' for ink. Drawn for a
+// terminal cell about twice as tall as wide, lowercase sits on rows 2 - 6
+struct GlyphBitmap {
+    char glyph;
+    const char* rows[8];
+};
+
+static const GlyphBitmap glyph_font[] = {
+    {' ', {"....", "....", "....", "....", "....", "....", "....", "...."}},
+    {'.', {"....", "....", "....", "....", "....", "....", ".##.", "...."}},
+    {',', {"....", "....", "....", "....", "....", ".##.", ".##.", ".#.."}},
+    {'\'', {".##.", ".##.", "....", "....", "....", "....", "....", "...."}},
+    {'`', {".#..", "..#.", "....", "....", "....", "....", "....", "...."}},
+    {'"', {"#..#", "#..#", "....", "....", "....", "....", "....", "...."}},
+    {'^', {".##.", "#..#", "....", "....", "....", "....", "....", "...."}},
+    {':', {"....", "....", ".##.", "....", "....", ".##.", "....", "...."}},
+    {';', {"....", "....", ".##.", "....", "....", ".##.", ".##.", ".#.."}},
+    {'-', {"....", "....", "....", "####", "....", "....", "....", "...."}},
+    {'_', {"....", "....", "....", "....", "....", "....", "....", "####"}},
+    {'~', {"....", "....", "....", ".#.#", "#.#.", "....", "....", "...."}},
+    {'=', {"....", "....", "####", "....", "####", "....", "....", "...."}},
+    {'+', {"....", ".##.", ".##.", "####", ".##.", ".##.", "....", "...."}},
+    {'*', {"....", "#..#", ".##.", "####", ".##.", "#..#", "....", "...."}},
+    {'|', {".##.", ".##.", ".##.", ".##.", ".##.", ".##.", ".##.", ".##."}},
+    {'/', {"...#", "...#", "..#.", "..#.", ".#..", ".#..", "#...", "#..."}},
+    {'\\', {"#...", "#...", ".#..", ".#..", "..#.", "..#.", "...#", "...#"}},
+    {'(', {"..#.", ".#..", "#...", "#...", "#...", "#...", ".#..", "..#."}},
+    {')', {".#..", "..#.", "...#", "...#", "...#", "...#", "..#.", ".#.."}},
+    {'[', {"###.", "#...", "#...", "#...", "#...", "#...", "#...", "###."}},
+    {']', {".###", "...#", "...#", "...#", "...#", "...#", "...#", ".###"}},
+    {'<', {"....", "...#", "..#.", ".#..", "#...", ".#..", "..#.", "...#"}},
+    {'>', {"....", "#...", ".#..", "..#.", "...#", "..#.", ".#..", "#..."}},
+    {'c', {"....", "....", ".###", "#...", "#...", "#...", ".###", "...."}},
+    {'o', {"....", "....", ".##.", "#..#", "#..#", "#..#", ".##.", "...."}},
+    {'v', {"....", "....", "#..#", "#..#", "#..#", ".##.", ".##.", "...."}},
+    {'x', {"....", "....", "#..#", ".##.", ".##.", ".##.", "#..#", "...."}},
+    {'r', {"....", "....", "#.##", "##..", "#...", "#...", "#...", "...."}},
+    {'n', {"....", "....", "###.", "#..#", "#..#", "#..#", "#..#", "...."}},
+    {'u', {"....", "....", "#..#", "#..#", "#..#", "#..#", ".###", "...."}},
+    {'L', {"#...", "#...", "#...", "#...", "#...", "#...", "####", "...."}},
+    {'T', {"####", ".##.", ".##.", ".##.", ".##.", ".##.", ".##.", "...."}},
+    {'Y', {"#..#", "#..#", ".##.", ".##.", ".##.", ".##.", ".##.", "...."}},
+    {'7', {"####", "...#", "..#.", "..#.", ".#..", ".#..", ".#..", "...."}},
+    {'J', {"...#", "...#", "...#", "...#", "...#", "#..#", ".##.", "...."}},
+    {'O', {".##.", "#..#", "#..#", "#..#", "#..#", "#..#", ".##.", "...."}},
+    {'X', {"#..#", "#..#", ".##.", ".##.", ".##.", "#..#", "#..#", "...."}},
+    {'V', {"#..#", "#..#", "#..#", "#..#", ".##.", ".##.", ".##.", "...."}},
+    {'H', {"#..#", "#..#", "#..#", "####", "#..#", "#..#", "#..#", "...."}},
+    {'A', {".##.", "#..#", "#..#", "####", "#..#", "#..#", "#..#", "...."}},
+    {'P', {"###.", "#..#", "#..#", "###.", "#...", "#...", "#...", "...."}},
+    {'E', {"####", "#...", "#...", "###.", "#...", "#...", "####", "...."}},
+    {'B', {"###.", "#..#", "#..#", "###.", "#..#", "#..#", "###.", "...."}},
+    {'8', {".##.", "#..#", "#..#", ".##.", "#..#", "#..#", ".##.", "...."}},
+    {'&', {".##.", "#..#", ".##.", ".#..", "#.##", "#..#", ".###", "...."}},
+    {'%', {"##.#", "##.#", "..#.", "..#.", ".#..", ".#..", "#.##", "#.##"}},
+    {'#', {".#.#", ".#.#", "####", ".#.#", ".#.#", "####", ".#.#", ".#.#"}},
+    {'W', {"#..#", "#..#", "#..#", "#..#", "####", "####", "#..#", "...."}},
+    {'M', {"#..#", "####", "####", "#..#", "#..#", "#..#", "#..#", "...."}},
+    {'@', {".##.", "#..#", "#.##", "#.##", "#.##", "#...", ".###", "...."}},
+    {'N', {"#..#", "##.#", "##.#", "#.##", "#.##", "#..#", "#..#", "#..#"}},
+    {'Q', {".##.", "#..#", "#..#", "#..#", "#.##", "#..#", ".###", "...#"}},
+    {'m', {"....", "....", "####", "####", "####", "#.##", "#..#", "...."}},
+};
+
+// Glyph atlas for structure matching. A cell is 4x8 brightness samples and is compared with
+// the ink mask of every glyph: sum of absolute differences plus the difference of the two
+// sums. The SAD alone scores every glyph alike on a flat gray cell, the sum term keeps the
+// tone. Both come from psadbw, two per glyph, and the smallest is kept without a branch
+struct StructureAtlas {
+    static constexpr int cell_width = 4, cell_height = 8, cell_size = cell_width * cell_height;
+
+    vector<unsigned char> bitmaps;   // cell_size bytes per glyph, 0 or 255
+    vector<int> sums;   // of every bitmap
+    vector<unsigned char> chars;
+
+    bool empty() const { return chars.empty(); }
+
+    // the glyphs of palette, or the whole font when palette is empty
+    void build(const string& palette) {
+        bitmaps.clear();
+        sums.clear();
+        chars.clear();
+        auto add = [&](const GlyphBitmap& bitmap) {
+            if (find(chars.begin(), chars.end(), (unsigned char)bitmap.glyph) != chars.end()) return;
+            int sum = 0;
+            for (int y = 0; y < cell_height; y++)
+                for (int x = 0; x < cell_width; x++) {
+                    unsigned char ink = bitmap.rows[y][x] == '#' ? 255 : 0;
+                    bitmaps.push_back(ink);
+                    sum += ink;
+                }
+            sums.push_back(sum);
+            chars.push_back(bitmap.glyph);
+        };
+
+        if (palette.empty())
+            for (const GlyphBitmap& bitmap : glyph_font) add(bitmap);
+        for (char glyph : palette) {
+            auto bitmap = find_if(begin(glyph_font), end(glyph_font), [&](const GlyphBitmap& b) { return b.glyph == glyph; });
+            if (bitmap == end(glyph_font))
+                throw runtime_error(string("No structure bitmap for the palette character '") + glyph + "'");
+            add(*bitmap);
+        }
+    }
+
+    // the best glyph for cell_size samples, row after row
+    unsigned char match(const unsigned char* cell) const {
+        uint32_t best = UINT32_MAX;   // distance << 8 | index, so ties go to the earlier glyph
+#if defined(__SSE2__)
+        const __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cell));
+        const __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cell + 16));
+        const __m128i zero = _mm_setzero_si128();
+        // psadbw leaves two 64 bit partial sums, each small enough for the low 32 bits
+        auto total = [](__m128i sad) { return _mm_cvtsi128_si32(_mm_add_epi32(sad, _mm_srli_si128(sad, 8))); };
+        const int sum = total(_mm_add_epi64(_mm_sad_epu8(top, zero), _mm_sad_epu8(bottom, zero)));
+
+        for (size_t g = 0; g < chars.size(); g++) {
+            const __m128i* bitmap = reinterpret_cast<const __m128i*>(bitmaps.data() + g * cell_size);
+            __m128i sad = _mm_add_epi64(_mm_sad_epu8(top, _mm_loadu_si128(bitmap)), _mm_sad_epu8(bottom, _mm_loadu_si128(bitmap + 1)));
+            uint32_t distance = total(sad) + abs(sum - sums[g]);
+            best = min(best, distance << 8 | (uint32_t)g);
+        }
+#else
+        int sum = 0;
+        for (int i = 0; i < cell_size; i++) sum += cell[i];
+        for (size_t g = 0; g < chars.size(); g++) {
+            const unsigned char* bitmap = bitmaps.data() + g * cell_size;
+            uint32_t distance = abs(sum - sums[g]);
+            for (int i = 0; i < cell_size; i++) distance += abs(cell[i] - bitmap[i]);
+            best = min(best, distance << 8 | (uint32_t)g);
+        }
+#endif
+        return chars[best & 0xFF];
+    }
+};
+
+#if defined(__SSSE3__)
+// one channel of 16 RGB pixels held in a, b and c, picked out with a shuffle per register
+static inline __m128i gather_channel(__m128i a, __m128i b, __m128i c, const signed char (&masks)[3][16]) {
+    __m128i from_a = _mm_shuffle_epi8(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[0])));
+    __m128i from_b = _mm_shuffle_epi8(b, _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[1])));
+    __m128i from_c = _mm_shuffle_epi8(c, _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[2])));
+    return _mm_or_si128(_mm_or_si128(from_a, from_b), from_c);
+}
+#endif
+
+// RGB24 -> gray with the weights stbi_load uses, (77 r + 150 g + 29 b) >> 8.
+// The weighted sum of a pixel is at most 255 * 256, so it fits 16 bit lanes
+void rgb_to_gray(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    static const signed char red[3][16] = {
+        {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13} };
+    static const signed char green[3][16] = {
+        {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14} };
+    static const signed char blue[3][16] = {
+        {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15} };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight_r = _mm_set1_epi16(77), weight_g = _mm_set1_epi16(150), weight_b = _mm_set1_epi16(29);
+    for (; i + 16 <= count; i += 16, src += 48) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i r = gather_channel(a, b, c, red), g = gather_channel(a, b, c, green), bl = gather_channel(a, b, c, blue);
+
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), weight_r),
+                                                 _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), weight_g)),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), weight_b));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), weight_r),
+                                                 _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), weight_g)),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), weight_b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; i < count; i++, src += 3)
+        dst[i] = (src[0] * 77 + src[1] * 150 + src[2] * 29) >> 8;
+}
+
+// Ordered 8x8 Bayer dithering in place. The levels of the glyph choice are 256 / (levels - 1)
+// apart, so every pixel is moved by its threshold offset in [-step / 2, step / 2) and the
+// quantizer that follows does the rest; a flat area then lands on the two nearest levels in
+// proportion, with two levels anywhere between black and white. The offsets repeat every
+// 8 pixels, so 16 pixels are one saturating add
+void dither_ordered(unsigned char* gray, int width, int height, int levels) {
+    static const unsigned char bayer[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41}, {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37}, {63, 31, 55, 23, 61, 29, 53, 21} };
+    const int bin = 256 / max(levels - 1, 1);   // the step between two levels
+    signed char offsets[8][16];
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 16; x++)
+            offsets[y][x] = max((2 * bayer[y][x % 8] + 1) * bin / 128 - bin / 2, -128);   // (t + 0.5) / 64 - 0.5 bins
+
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = gray + (size_t)y * width;
+        const signed char* offset = offsets[y % 8];
+        int x = 0;
+#if defined(__SSE2__)
+        // unsigned + signed with saturation: flip the top bits, add signed, flip back
+        const __m128i flip = _mm_set1_epi8((char)0x80);
+        const __m128i add = _mm_loadu_si128(reinterpret_cast<const __m128i*>(offset));
+        for (; x + 16 <= width; x += 16) {
+            __m128i px = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x)), flip);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), _mm_xor_si128(_mm_adds_epi8(px, add), flip));
+        }
+#endif
+        for (; x < width; x++)
+            row[x] = clamp(row[x] + offset[x % 16], 0, 255);
+    }
+}
+
+// Floyd-Steinberg or Atkinson error diffusion in place, every pixel becomes the nearest of
+// levels values k * 255 / (levels - 1), each inside the glyph bin of k. A row needs the error
+// pushed down by the rows above it, so rows run as a wavefront: thread t of the team takes
+// rows t, t + threads, ... and stays a chunk plus two pixels behind the row above. The error to
+// the right is carried in registers, so no two rows ever write the same pixel at once.
+// threads may be below the team size, the members past it have nothing to do
+void dither_diffuse(unsigned char* gray, int width, int height, int levels, bool atkinson, unsigned threads,
+                    ThreadTeam* team, vector<int16_t>& errors) {
+    if (!team) threads = 1;
+    if (width <= 0 || height <= 0) return;
+    levels = max(levels, 2);
+    unsigned char nearest[256];
+    for (int v = 0; v < 256; v++)
+        nearest[v] = (v * (levels - 1) + 127) / 255 * 255 / (levels - 1);
+
+    // errors pushed down, one row of padding on each side so x - 1 and x + 1 need no checks
+    const size_t stride = width + 2;
+    errors.assign(stride * (height + 2), 0);
+    const int chunk = 64;
+    unique_ptr<atomic<int>[]> progress(threads > 1 ? new atomic<int>[height] : nullptr);
+    if (progress)
+        for (int y = 0; y < height; y++) progress[y].store(0, memory_order_relaxed);
+
+    auto run_row = [&](int y) {
+        unsigned char* row = gray + (size_t)y * width;
+        const int16_t* here = errors.data() + y * stride + 1;
+        int16_t* below = errors.data() + (y + 1) * stride + 1;
+        int16_t* below2 = errors.data() + (y + 2) * stride + 1;
+        int carry = 0, carry2 = 0;   // error for x + 1 and, Atkinson only, x + 2
+        for (int x0 = 0; x0 < width; x0 += chunk) {
+            const int x1 = min(x0 + chunk, width);
+            if (progress && y > 0) {
+                const int needed = min(x1 + 1, width);   // below[x] of the row above gets written up to x + 1
+                while (progress[y - 1].load(memory_order_acquire) < needed)
+                    this_thread::yield();
+            }
+            for (int x = x0; x < x1; x++) {
+                int total = row[x] + here[x] + carry;
+                int value = nearest[clamp(total, 0, 255)];
+                int error = total - value;
+                row[x] = value;
+                if (atkinson) {
+                    int eighth = error >> 3;   // 6/8 of the error travels, the rest is dropped
+                    carry = carry2 + eighth;
+                    carry2 = eighth;
+                    below[x - 1] += eighth;
+                    below[x] += eighth;
+                    below[x + 1] += eighth;
+                    below2[x] += eighth;
+                } else {
+                    carry = error * 7 >> 4;
+                    below[x - 1] += error * 3 >> 4;
+                    below[x] += error * 5 >> 4;
+                    below[x + 1] += error >> 4;
+                }
+            }
+            if (progress) progress[y].store(x1, memory_order_release);
+        }
+    };
+
+    if (!progress) {
+        for (int y = 0; y < height; y++) run_row(y);
+        return;
+    }
+    team->run([&](unsigned t) {
+        if (t >= threads) return;
+        for (int y = t; y < height; y += threads) run_row(y);
+    });
+}
+
+// xterm 256 color index for every color at 5 bits per channel. The 6x6x6 cube is a product
+// of levels, so its nearest entry is the nearest level per channel; of the 24 grays the
+// nearest is the one closest to the mean. The closer of the two candidates wins
+struct Ansi256Table {
+    unsigned char index[32 * 32 * 32];
+
+    Ansi256Table() {
+        static const int levels[6] = {0, 95, 135, 175, 215, 255};
+        for (int packed = 0; packed < 32 * 32 * 32; packed++) {
+            int rgb[3] = { (packed >> 10 << 3) | 4, (packed >> 5 & 31) << 3 | 4, (packed & 31) << 3 | 4 };
+            int cube = 0, cube_distance = 0, mean = (rgb[0] + rgb[1] + rgb[2]) / 3;
+            for (int c = 0; c < 3; c++) {
+                int best = 0;
+                for (int l = 1; l < 6; l++)
+                    if (abs(levels[l] - rgb[c]) < abs(levels[best] - rgb[c])) best = l;
+                cube = cube * 6 + best;
+                cube_distance += (levels[best] - rgb[c]) * (levels[best] - rgb[c]);
+            }
+            int gray = clamp((mean - 3) / 10, 0, 23);   // levels 8 + 10 i
+            if (gray < 23 && abs(8 + 10 * (gray + 1) - mean) < abs(8 + 10 * gray - mean)) gray++;
+            int gray_distance = 0;
+            for (int c = 0; c < 3; c++)
+                gray_distance += (8 + 10 * gray - rgb[c]) * (8 + 10 * gray - rgb[c]);
+            index[packed] = gray_distance < cube_distance ? 232 + gray : 16 + cube;
+        }
+    }
+
+    unsigned char lookup(const unsigned char* rgb) const {
+        return index[(rgb[0] >> 3) << 10 | (rgb[1] >> 3) << 5 | rgb[2] >> 3];
+    }
+};
+
+const Ansi256Table& ansi256_table() {
+    static const Ansi256Table table;
+    return table;
+}
+
+// UTF-8 of every quadrant block and braille pattern, by the bit pattern of a cell: bit
+// y * 2 + x for its sample at (x, y). Entries are padded to 4 bytes, so a cell is one
+// 4 byte store and the write position moves on by size
+struct UnicodeCells {
+    unsigned char bytes[256][4] = {};
+    unsigned char size[256] = {};
+
+    explicit UnicodeCells(bool braille) {
+        // quadrants in bit order: none, upper left, upper right, upper half, lower left, ...
+        static const uint16_t quadrants[16] = {0x20, 0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+                                               0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588};
+        // braille dot bit of each sample, dots 1 2 3 7 run down the left column and 4 5 6 8 the right
+        static const int dots[8] = {0, 3, 1, 4, 2, 5, 6, 7};
+        for (int pattern = 0; pattern < (braille ? 256 : 16); pattern++) {
+            unsigned codepoint = quadrants[pattern & 15];
+            if (braille) {
+                codepoint = 0x2800;
+                for (int bit = 0; bit < 8; bit++)
+                    codepoint |= (pattern >> bit & 1) << dots[bit];
+            }
+            if (codepoint < 0x80) {
+                bytes[pattern][0] = codepoint;
+                size[pattern] = 1;
+            } else {   // every other one is in 0x800 - 0xFFFF, three bytes
+                bytes[pattern][0] = 0xE0 | codepoint >> 12;
+                bytes[pattern][1] = 0x80 | (codepoint >> 6 & 0x3F);
+                bytes[pattern][2] = 0x80 | (codepoint & 0x3F);
+                size[pattern] = 3;
+            }
+        }
+    }
+};
+
+const UnicodeCells& unicode_cells(GlyphMode mode) {
+    static const UnicodeCells quadrant(false), braille(true);
+    return mode == GlyphMode::Braille ? braille : quadrant;
+}
+
+static inline unsigned char* put_decimal(unsigned char* out, unsigned value) {
+    if (value >= 100) *out++ = '0' + value / 100;
+    if (value >= 10) *out++ = '0' + value / 10 % 10;
+    *out++ = '0' + value % 10;
+    return out;
+}
+
+void write_all(int fd, const unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) throw runtime_error(string("Failed to write: ") + strerror(errno));
+        data += written;
+        size -= written;
+    }
+}
+
+// false when the stream ends before the first byte, a stream that ends half way is an error
+bool read_all(int fd, unsigned char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = read(fd, data + done, size - done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) throw runtime_error(string("Failed to read: ") + strerror(errno));
+        if (got == 0) {
+            if (done == 0) return false;
+            throw runtime_error("Unexpected end of stream");
+        }
+        done += got;
+    }
+    return true;
+}
+
+// the frame is already one contiguous buffer, so a file is one open and (usually) one write
+void write_file(const string& path, const unsigned char* data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw runtime_error("Failed to create the file: " + path);
+    try {
+        write_all(fd, data, size);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+PngBackend png_backend = PngBackend::Builtin;   // see set_png_backend
+
+}
+
+bool png_backend_available(PngBackend backend) {
+#ifndef ASCII_WITH_ZLIB
+    if (backend == PngBackend::Zlib) return false;
+#endif
+#ifndef ASCII_WITH_LIBDEFLATE
+    if (backend == PngBackend::Libdeflate) return false;
+#endif
+    return true;
+}
+
+void set_png_backend(PngBackend backend) {
+    if (!png_backend_available(backend))
+        throw runtime_error("This build has no such PNG backend, rebuild with ASCII_WITH_ZLIB or ASCII_WITH_LIBDEFLATE");
+    png_backend = backend;
+    // stored data does not shrink with a better filter, so skip the five way filter search
+    stbi_write_force_png_filter = backend == PngBackend::Store ? 0 : -1;
+}
+
+namespace {
+
+// zlib stream of stored blocks: framing and checksum only, no compression
+static unsigned char* zlib_store(const unsigned char* data, int data_len, int* out_len) {
+    int blocks = max((data_len + 65534) / 65535, 1);
+    unsigned char* out = static_cast<unsigned char*>(pool_alloc(2 + blocks * 5 + data_len + 4));
+    if (!out) return nullptr;
+
+    unsigned char* o = out;
+    *o++ = 0x78;   // 32K window
+    *o++ = 0x01;   // no preset dictionary, fastest level, header checksum
+    int pos = 0;
+    do {
+        int len = min(data_len - pos, 65535);
+        *o++ = pos + len == data_len;   // BFINAL on the last block, BTYPE 00 = stored
+        *o++ = len & 0xFF;
+        *o++ = len >> 8;
+        *o++ = ~len & 0xFF;
+        *o++ = (~len >> 8) & 0xFF;
+        memcpy(o, data + pos, len);
+        o += len;
+        pos += len;
+    } while (pos < data_len);
+
+    uint32_t a = 1, b = 0;   // adler32, reduced every 5552 bytes before it can overflow
+    for (int i = 0; i < data_len; ) {
+        int chunk_end = min(data_len, i + 5552);
+        for (; i < chunk_end; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    *o++ = b >> 8;
+    *o++ = b & 0xFF;
+    *o++ = a >> 8;
+    *o++ = a & 0xFF;
+
+    *out_len = o - out;
+    return out;
+}
+
+// the result must come from pool_alloc, stb_image_write frees it
+unsigned char* png_deflate(unsigned char* data, int data_len, int* out_len, int quality) {
+    switch (png_backend) {
+        case PngBackend::Store:
+            return zlib_store(data, data_len, out_len);
+#ifdef ASCII_WITH_ZLIB
+        case PngBackend::Fast:
+        case PngBackend::Zlib: {
+            uLongf size = compressBound(data_len);
+            unsigned char* out = static_cast<unsigned char*>(pool_alloc(size));
+            if (!out) return nullptr;
+            if (compress2(out, &size, data, data_len, png_backend == PngBackend::Fast ? 1 : Z_DEFAULT_COMPRESSION) != Z_OK) {
+                pool_free(out);
+                return nullptr;
+            }
+            *out_len = size;
+            return out;
+        }
+#else
+        case PngBackend::Fast:   // shortest hash chains the builtin allows
+            return stbiw__zlib_compress_builtin(data, data_len, out_len, 1);
+#endif
+#ifdef ASCII_WITH_LIBDEFLATE
+        case PngBackend::Libdeflate: {
+            thread_local unique_ptr<libdeflate_compressor, void (*)(libdeflate_compressor*)>
+                compressor(libdeflate_alloc_compressor(6), libdeflate_free_compressor);
+            size_t bound = libdeflate_zlib_compress_bound(compressor.get(), data_len);
+            unsigned char* out = static_cast<unsigned char*>(pool_alloc(bound));
+            if (!out) return nullptr;
+            size_t size = libdeflate_zlib_compress(compressor.get(), data, data_len, out, bound);
+            if (size == 0) {
+                pool_free(out);
+                return nullptr;
+            }
+            *out_len = size;
+            return out;
+        }
+#endif
+        default:
+            return stbiw__zlib_compress_builtin(data, data_len, out_len, quality);
+    }
+}
+
+// Encodes the intermediate PNGs on a background thread, so deflate overlaps the next decode.
+// Jobs carry their own copy of the (already downscaled) image. push blocks while more than
+// max_bytes are waiting, so a slow encoder throttles the workers instead of eating memory.
+// Written buffers come back through spare, so the copies stop allocating once warmed up.
+class PngWriterQueue {
+    private:
+        struct Job {
+            string path;
+            int width, height, channels;
+            PixelBuffer pixels;
+        };
+
+        mutex lock;
+        condition_variable has_work, has_room;
+        deque<Job> jobs;
+        vector<PixelBuffer> spare;
+        size_t queued_bytes = 0;
+        size_t max_bytes;
+        bool stopping = false;
+        thread worker;
+
+        void drain() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                has_work.wait(guard, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;   // stopping and nothing left
+
+                Job job = move(jobs.front());
+                jobs.pop_front();
+                guard.unlock();
+
+                if (!stbi_write_png(job.path.c_str(), job.width, job.height, job.channels, job.pixels.data(), job.width * job.channels))
+                    log_line(cerr, "Failed to write " + job.path);
+
+                guard.lock();
+                queued_bytes -= job.pixels.size();
+                if (spare.size() < 4)
+                    spare.push_back(move(job.pixels));
+                has_room.notify_all();
+            }
+        }
+
+    public:
+        explicit PngWriterQueue(size_t max_bytes = 64 << 20) : max_bytes(max_bytes) {
+            worker = thread(&PngWriterQueue::drain, this);
+        }
+        PngWriterQueue(const PngWriterQueue&) = delete;
+        PngWriterQueue& operator=(const PngWriterQueue&) = delete;
+
+        // finishes every queued image before returning
+        ~PngWriterQueue() {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            has_work.notify_all();
+            worker.join();
+        }
+
+        void push(const string& path, int width, int height, int channels, const unsigned char* pixels) {
+            size_t size = (size_t)width * height * channels;
+            unique_lock<mutex> guard(lock);
+            // an image bigger than the whole budget still goes through once the queue is empty
+            has_room.wait(guard, [&]() { return queued_bytes == 0 || queued_bytes + size <= max_bytes; });
+            PixelBuffer copy;
+            if (!spare.empty()) {
+                copy = move(spare.back());
+                spare.pop_back();
+            }
+            copy.resize(size);
+            jobs.push_back({path, width, height, channels, move(copy)});
+            memcpy(jobs.back().pixels.data(), pixels, size);
+            queued_bytes += size;
+            has_work.notify_one();
+        }
+};
+
+// 64 bit hash, 8 bytes per step with multiply/rotate mixing and a splitmix finisher.
+// Not cryptographic, just fast enough that hashing an input costs less than reading it.
+uint64_t hash_bytes(const unsigned char* data, size_t size, uint64_t seed = 0) {
+    const uint64_t k1 = 0x9E3779B97F4A7C15ull, k2 = 0xBF58476D1CE4E5B9ull;
+    uint64_t h = seed ^ (size * k1);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h ^= word * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    uint64_t tail = 0;
+    if (size > i) memcpy(&tail, data + i, size - i);   // data may be null for an empty input
+    h ^= tail * k1;
+
+    h ^= h >> 30; h *= k2;
+    h ^= h >> 27; h *= 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+uint64_t hash_string(const string& text) {
+    return hash_bytes(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+}
+
+// Remembers which inputs were converted with which settings, so reruns over the same
+// folders skip them. An entry is trusted as is while the file size and mtime still match.
+// Otherwise the bytes are hashed: unchanged content is a hit, and content already converted
+// under another name has its outputs copied instead of being decoded again.
+class OutputCache {
+    public:
+        struct Entry {
+            uint64_t size = 0;
+            int64_t mtime = 0;      // nanoseconds
+            uint64_t content = 0;   // hash_bytes of the input
+            uint64_t params = 0;    // hash of everything that shapes the outputs
+        };
+
+    private:
+        static constexpr char magic[8] = {'A', 'S', 'C', 'I', 'I', 'I', 'D', '1'};
+        string index_path;
+        unordered_map<string, Entry> entries;
+        unordered_map<uint64_t, string> by_content;   // content and params -> a path that has outputs
+
+        static uint64_t content_key(uint64_t content, uint64_t params) {
+            return content ^ (params * 0x9E3779B97F4A7C15ull);
+        }
+
+    public:
+        explicit OutputCache(const string& index_path) : index_path(index_path) {}
+
+        // layout: magic, entry count, then per entry u16 path length, path, size, mtime, content, params
+        void load() {
+            ifstream in(index_path, ios::binary);
+            char header[8];
+            uint64_t count;
+            if (!in.read(header, 8) || memcmp(header, magic, 8) != 0 || !in.read(reinterpret_cast<char*>(&count), 8))
+                return;   // no index yet, or one this version can not read: start over
+
+            for (uint64_t i = 0; i < count; i++) {
+                uint16_t path_size;
+                Entry entry;
+                if (!in.read(reinterpret_cast<char*>(&path_size), 2)) break;
+                string path(path_size, '\0');
+                if (!in.read(&path[0], path_size) || !in.read(reinterpret_cast<char*>(&entry), sizeof(entry))) break;
+                record(path, entry);
+            }
+        }
+
+        // written next to the index and renamed over it, so an interrupted run never leaves half an index
+        void save() const {
+            string temp_path = index_path + ".tmp";
+            {
+                ofstream out(temp_path, ios::binary | ios::trunc);
+                uint64_t count = entries.size();
+                out.write(magic, 8);
+                out.write(reinterpret_cast<const char*>(&count), 8);
+                for (const auto& [path, entry] : entries) {
+                    uint16_t path_size = min<size_t>(path.size(), UINT16_MAX);
+                    out.write(reinterpret_cast<const char*>(&path_size), 2);
+                    out.write(path.data(), path_size);
+                    out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+                }
+                if (!out) {
+                    log_line(cerr, "Failed to write the cache index " + temp_path);
+                    return;
+                }
+            }
+            fs::rename(temp_path, index_path);
+        }
+
+        const Entry* find(const string& path) const {
+            auto it = entries.find(path);
+            return it == entries.end() ? nullptr : &it->second;
+        }
+
+        const string* find_content(uint64_t content, uint64_t params) const {
+            auto it = by_content.find(content_key(content, params));
+            return it == by_content.end() ? nullptr : &it->second;
+        }
+
+        void record(const string& path, const Entry& entry) {
+            entries[path] = entry;
+            by_content[content_key(entry.content, entry.params)] = path;
+        }
+};
+
+// What the planning pass learns from a file header, no pixels are decoded for it
+struct ImageJob {
+    string path;
+    int width = 0, height = 0, channels = 0;
+    int orientation = 0;
+    bool is_jpeg = false;
+    size_t cost = 0;   // input bytes plus decoded pixels, only used to balance the workers
+};
+
+// One input of the --bench corpus, encoded in memory
+struct BenchImage {
+    string name;
+    int width, height, orientation;
+    vector<unsigned char> bytes;
+};
+
+// Reproducible corpus: the same pixels on every run and machine (gradients, rings and
+// LCG noise), JPEGs at several sizes with an EXIF orientation, PNGs at the same sizes
+vector<BenchImage> make_bench_corpus() {
+    struct Spec { int width, height, orientation; bool jpeg; };
+    const Spec specs[] = { {640, 480, 1, true}, {640, 480, 3, true}, {1920, 1080, 1, true}, {1920, 1080, 6, true},
+                           {4032, 3024, 1, true}, {4032, 3024, 8, true}, {640, 480, 0, false}, {1920, 1080, 0, false},
+                           {4032, 3024, 0, false} };
+    vector<BenchImage> corpus;
+    for (const Spec& spec : specs) {
+        vector<unsigned char> pixels((size_t)spec.width * spec.height * 3);
+        uint32_t seed = 12345;
+        for (int y = 0; y < spec.height; y++)
+            for (int x = 0; x < spec.width; x++) {
+                seed = seed * 1664525 + 1013904223;
+                int dx = x - spec.width / 2, dy = y - spec.height / 2;
+                int ring = ((dx * dx + dy * dy) >> 10) & 63;
+                unsigned char* px = &pixels[((size_t)y * spec.width + x) * 3];
+                px[0] = (x * 255 / spec.width + ring) & 255;
+                px[1] = (y * 255 / spec.height + (seed >> 28)) & 255;
+                px[2] = (ring * 4) ^ (x & y & 31);
+            }
+
+        BenchImage image = { (spec.jpeg ? "jpeg_" : "png_") + to_string(spec.width) + "x" + to_string(spec.height)
+                             + (spec.jpeg ? "_o" + to_string(spec.orientation) : ""), spec.width, spec.height, spec.orientation, {} };
+        auto append = [](void* context, void* data, int size) {
+            vector<unsigned char>* out = static_cast<vector<unsigned char>*>(context);
+            out->insert(out->end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+        };
+        if (spec.jpeg) {
+            if (!stbi_write_jpg_to_func(append, &image.bytes, spec.width, spec.height, 3, pixels.data(), 90))
+                throw runtime_error("Failed to encode the benchmark corpus");
+            // APP1 right after SOI: "Exif", a little endian TIFF header and one IFD0 entry, the orientation
+            const unsigned char app1[] = { 0xFF, 0xE1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0, 0, 'I', 'I', 42, 0, 8, 0, 0, 0,
+                                           1, 0, 0x12, 0x01, 3, 0, 1, 0, 0, 0, (unsigned char)spec.orientation, 0, 0, 0,
+                                           0, 0, 0, 0 };
+            image.bytes.insert(image.bytes.begin() + 2, begin(app1), end(app1));
+        } else if (!stbi_write_png_to_func(append, &image.bytes, spec.width, spec.height, 3, pixels.data(), spec.width * 3))
+            throw runtime_error("Failed to encode the benchmark corpus");
+        corpus.push_back(move(image));
+    }
+    return corpus;
+}
+
+// Log-linear latency buckets, 8 per power of two: about 12% resolution at any
+// magnitude, fixed size, and two histograms merge by adding the counts
+class LatencyHistogram {
+    private:
+        static const int sub_bits = 3;
+        uint64_t counts[64 << sub_bits] = {};
+        uint64_t total = 0;
+
+        static int bucket(uint64_t us) {
+            if (us < (1u << sub_bits)) return us;
+            int msb = 63 - __builtin_clzll(us);
+            return ((msb - sub_bits + 1) << sub_bits) + ((us >> (msb - sub_bits)) & ((1 << sub_bits) - 1));
+        }
+
+        static uint64_t lower_bound(int index) {
+            if (index < (1 << sub_bits)) return index;
+            int msb = (index >> sub_bits) + sub_bits - 1;
+            return (uint64_t(1) << msb) | (uint64_t(index & ((1 << sub_bits) - 1)) << (msb - sub_bits));
+        }
+
+    public:
+        void record(uint64_t us) {
+            counts[bucket(us)]++;
+            total++;
+        }
+
+        uint64_t count() const { return total; }
+
+        // middle of the bucket holding the p-th fraction of the samples, in microseconds
+        double percentile(double p) const {
+            if (total == 0) return 0;
+            uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(p * total)), seen = 0;
+            for (int i = 0; i < (64 << sub_bits); i++) {
+                seen += counts[i];
+                if (seen >= rank) return (lower_bound(i) + (i + 1 < (64 << sub_bits) ? lower_bound(i + 1) : lower_bound(i))) / 2.0;
+            }
+            return 0;
+        }
+};
+
+}
+
+// Optional per-stage instrumentation. Engines hold a pointer that stays null unless
+// --trace is given, so a disabled span is one branch and no clock read. Spans are kept
+// for the Chrome trace file and folded into a histogram per stage for the summary
+class Tracer::Log {
+    private:
+        struct Span {
+            const char* stage;
+            string detail;
+            uint64_t start_us, duration_us, bytes;
+            unsigned thread;
+        };
+        struct StageTotals {
+            const char* stage;
+            LatencyHistogram times;
+            uint64_t total_us = 0, bytes = 0;
+        };
+
+        mutex lock;
+        vector<Span> spans;
+        vector<StageTotals> stages;   // in the order they were first seen
+        const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+        atomic<unsigned> next_thread{0};
+
+        static void append_json_string(string& out, const string& text) {
+            out += '"';
+            for (char c : text) {
+                if (c == '"' || c == '\\') out += '\\';
+                if ((unsigned char)c < 0x20) continue;
+                out += c;
+            }
+            out += '"';
+        }
+
+    public:
+        uint64_t now_us() const {
+            return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - origin).count();
+        }
+
+        // small stable numbers for the trace viewer rows
+        unsigned thread_id() {
+            thread_local unsigned id = next_thread++;
+            return id;
+        }
+
+        void record(const char* stage, uint64_t start_us, uint64_t bytes, string detail) {
+            uint64_t duration = now_us() - start_us;
+            unsigned thread = thread_id();
+            lock_guard<mutex> guard(lock);
+            spans.push_back({stage, move(detail), start_us, duration, bytes, thread});
+            auto totals = find_if(stages.begin(), stages.end(), [&](const StageTotals& t) { return strcmp(t.stage, stage) == 0; });
+            if (totals == stages.end()) {
+                stages.push_back({stage, {}, 0, 0});
+                totals = stages.end() - 1;
+            }
+            totals->times.record(duration);
+            totals->total_us += duration;
+            totals->bytes += bytes;
+        }
+
+        string summary() {
+            lock_guard<mutex> guard(lock);
+            string table = "stage           count   total ms     p50 ms     p99 ms         MB      MB/s";
+            for (const StageTotals& t : stages) {
+                char line[160];
+                double megabytes = t.bytes / 1e6;
+                snprintf(line, sizeof(line), "\n%-12s %8llu %10.2f %10.3f %10.3f %10.2f %9.1f", t.stage,
+                         (unsigned long long)t.times.count(), t.total_us / 1000.0, t.times.percentile(0.50) / 1000,
+                         t.times.percentile(0.99) / 1000, megabytes, t.total_us ? megabytes / (t.total_us / 1e6) : 0.0);
+                table += line;
+            }
+            return table;
+        }
+
+        // Chrome trace event format, complete events ("ph": "X"), loads in chrome://tracing and Perfetto
+        void write_chrome_trace(const string& path) {
+            lock_guard<mutex> guard(lock);
+            string json = "{\"traceEvents\": [\n";
+            for (size_t i = 0; i < spans.size(); i++) {
+                const Span& span = spans[i];
+                char head[192];
+                snprintf(head, sizeof(head), "{\"name\": \"%s\", \"cat\": \"ascii\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, "
+                         "\"pid\": 1, \"tid\": %u, \"args\": {\"bytes\": %llu", span.stage, (unsigned long long)span.start_us,
+                         (unsigned long long)span.duration_us, span.thread, (unsigned long long)span.bytes);
+                json += head;
+                if (!span.detail.empty()) {
+                    json += ", \"file\": ";
+                    append_json_string(json, span.detail);
+                }
+                json += i + 1 < spans.size() ? "}},\n" : "}}\n";
+            }
+            json += "]}\n";
+            write_file(path, reinterpret_cast<const unsigned char*>(json.data()), json.size());
+        }
+};
+
+Tracer::Tracer() : log(make_unique<Log>()) {}
+Tracer::~Tracer() = default;
+string Tracer::summary() { return log->summary(); }
+void Tracer::write_chrome_trace(const string& path) { log->write_chrome_trace(path); }
+
+namespace {
+
+// Times the enclosing scope as one stage. Without a tracer it does nothing
+class TraceSpan {
+    private:
+        Tracer* tracer;
+        const char* stage;
+        uint64_t start = 0;
+
+    public:
+        uint64_t bytes;
+        string detail;
+
+        TraceSpan(Tracer* tracer, const char* stage, uint64_t bytes = 0) : tracer(tracer), stage(stage), bytes(bytes) {
+            if (tracer) start = tracer->log->now_us();
+        }
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+        ~TraceSpan() {
+            if (tracer) tracer->log->record(stage, start, bytes, move(detail));
+        }
+};
+
+#if defined(__SSE2__)
+// rows[i] holds row i of an 8x8 byte tile in its low half. Column j of the tile is
+// stored as a row at dst + j * dst_stride (the stride may be negative).
+static inline void transpose_8x8(const __m128i rows[8], unsigned char* dst, ptrdiff_t dst_stride) {
+    __m128i a0 = _mm_unpacklo_epi8(rows[0], rows[1]);
+    __m128i a1 = _mm_unpacklo_epi8(rows[2], rows[3]);
+    __m128i a2 = _mm_unpacklo_epi8(rows[4], rows[5]);
+    __m128i a3 = _mm_unpacklo_epi8(rows[6], rows[7]);
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i columns[4] = { _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),
+                           _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3) };   // two columns each
+    for (int j = 0; j < 4; j++) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + (2 * j) * dst_stride), columns[j]);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + (2 * j + 1) * dst_stride), _mm_unpackhi_epi64(columns[j], columns[j]));
+    }
+}
+#endif
+
+}
+
+class ToAscii::Engine {
+    private:
+        //const string default_palette = "@%#*+=-:~. ";
+        const string default_palette = " .~:-=+*#&@";   // Great for black background terminal
+        string palette;   // set by configure
+
+        PixelBuffer image_data;
+        PixelBuffer scratch;   // resize and rotation target, swapped with image_data and kept for the next image
+        int pixel_channels = 1;   // 3 when image_data holds RGB for the color modes
+        PixelBuffer luma;   // color modes: brightness of every cell, then its glyph
+        PixelBuffer cell_colors;   // structure with color: mean RGB of every cell
+        StructureAtlas atlas;   // GlyphMode::Structure only, rebuilt with the palette
+        vector<int16_t> dither_errors;   // error diffusion, reused from frame to frame
+        unique_ptr<ThreadTeam> dither_team;   // its wavefront threads, also kept from frame to frame
+        uint64_t dither_micros = 0;   // time of the last dither, for the stage timings
+        int orientation = 0;   // EXIF value of the current image
+        int width = 0, height = 0;
+        int grid_width = 0, grid_height = 0;   // output size in characters, set by plan_grid
+        string filename;
+        vector <unsigned char> ascii_form;   // text frame, reused from image to image
+        GlyphTable glyphs;   // rebuilt only when the palette changes
+
+        PipelineOptions options;
+        shared_ptr<PngWriterQueue> png_writer;   // PngMode::Async only, shared by the batch workers
+        AxisWeights column_weights, row_weights;   // area resize tables, rebuilt per image
+        vector <uint32_t> row_sums;
+
+        int biggest_common_div(int a, int b) { // it uses Euclidean algorithm and recursion
+            if (a == 0) return b;
+            return biggest_common_div(b % a, a);
+        }
+
+        vector<int> common_divisors(int a, int b) { // it gets the common divisors from BCD
+            int BCD = biggest_common_div(a,b);
+            if (BCD <= 0) return {};
+
+            std::vector<int> factors;
+            int sqrt_n = static_cast<int>(std::sqrt(BCD));
+
+            // Find all factor pairs
+            for (int i = 1; i <= sqrt_n; i++)
+                if (BCD % i == 0) {
+                    factors.push_back(i);           // Add the smaller factor
+                    if (i != BCD / i)
+                        factors.push_back(BCD / i);   // Add the larger factor
+                }
+            std::sort(factors.begin(), factors.end());
+            return factors;
+        }
+
+        int get_index(int row, int col) {
+            return row * width + col;
+        }
+
+        // Functions regarding orientation problem. They run on the downscaled grid, write into
+        // the reusable scratch buffer and move 8x8 tiles at a time, so both sides stay in cache
+        void rotate90CW() {
+            scratch.resize(image_data.size());
+            // dst[c][height-1-r] = src[r][c]: a transpose of the tile with its rows fed bottom up
+            for (int r0 = 0; r0 < height; r0 += 8)
+                for (int c0 = 0; c0 < width; c0 += 8) {
+#if defined(__SSE2__)
+                    if (r0 + 8 <= height && c0 + 8 <= width) {
+                        __m128i rows[8];
+                        for (int i = 0; i < 8; i++)
+                            rows[i] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(image_data.data() + (size_t)(r0 + 7 - i) * width + c0));
+                        transpose_8x8(rows, scratch.data() + (size_t)c0 * height + (height - 8 - r0), height);
+                        continue;
+                    }
+#endif
+                    for (int r = r0; r < min(r0 + 8, height); r++)
+                        for (int c = c0; c < min(c0 + 8, width); c++)
+                            scratch[(size_t)c * height + (height - 1 - r)] = image_data[(size_t)r * width + c];
+                }
+
+            image_data.swap(scratch);
+            swap(width, height);
+        }
+
+        void rotate180() {
+            scratch.resize(image_data.size());
+            // a 180 turn is the whole buffer read backwards
+            const unsigned char* src = image_data.data();
+            unsigned char* dst = scratch.data() + image_data.size();
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 16 <= image_data.size(); i += 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                v = _mm_shuffle_epi32(v, 0x1B);   // reverse the dwords
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);   // then the words inside them
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));   // then the bytes inside those
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst - i - 16), v);
+            }
+#endif
+            for (; i < image_data.size(); i++)
+                dst[-1 - (ptrdiff_t)i] = src[i];
+
+            image_data.swap(scratch);
+        }
+
+        void rotate90CCW() {
+            scratch.resize(image_data.size());
+            // dst[width-1-c][r] = src[r][c]: a plain transpose written from the last row upwards
+            for (int r0 = 0; r0 < height; r0 += 8)
+                for (int c0 = 0; c0 < width; c0 += 8) {
+#if defined(__SSE2__)
+                    if (r0 + 8 <= height && c0 + 8 <= width) {
+                        __m128i rows[8];
+                        for (int i = 0; i < 8; i++)
+                            rows[i] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(image_data.data() + (size_t)(r0 + i) * width + c0));
+                        transpose_8x8(rows, scratch.data() + (size_t)(width - 1 - c0) * height + r0, -(ptrdiff_t)height);
+                        continue;
+                    }
+#endif
+                    for (int r = r0; r < min(r0 + 8, height); r++)
+                        for (int c = c0; c < min(c0 + 8, width); c++)
+                            scratch[(size_t)(width - 1 - c) * height + r] = image_data[(size_t)r * width + c];
+                }
+
+            image_data.swap(scratch);
+            swap(width, height);
+        }
+
+        static unsigned read_u16(const unsigned char* p, bool big_endian) {
+            return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+        }
+
+        static unsigned long read_u32(const unsigned char* p, bool big_endian) {
+            return big_endian ? (unsigned long)read_u16(p, true) << 16 | read_u16(p + 2, true)
+                              : (unsigned long)read_u16(p + 2, false) << 16 | read_u16(p, false);
+        }
+
+        // Reads the orientation tag straight from the encoded bytes. Only the JPEG header
+        // is walked, it stops at the first APP1 "Exif" segment or at start of scan.
+        // Returns 0 when there is no orientation to apply (non JPEG, no EXIF, no tag).
+        int get_exif_orientation(const unsigned char* bytes, size_t size) {
+            if (size < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) return 0;  // not a JPEG
+
+            size_t pos = 2;
+            while (pos + 4 <= size) {
+                if (bytes[pos] != 0xFF) return 0;   // lost sync, header is broken
+                unsigned char marker = bytes[pos + 1];
+                if (marker == 0xFF) { pos++; continue; }   // fill byte
+                if (marker == 0xDA || marker == 0xD9) return 0;   // pixels start, no APP1 before them
+                if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; }  // no payload
+
+                size_t segment_len = read_u16(bytes + pos + 2, true);
+                size_t payload = pos + 4;
+                if (segment_len < 2 || pos + 2 + segment_len > size) return 0;
+
+                if (marker == 0xE1 && segment_len >= 8 + 6 && memcmp(bytes + payload, "Exif\0\0", 6) == 0)
+                    return parse_tiff_orientation(bytes + payload + 6, segment_len - 2 - 6);
+
+                pos += 2 + segment_len;
+            }
+            return 0;
+        }
+
+        // tiff points at the TIFF header inside APP1, only IFD0 is searched
+        int parse_tiff_orientation(const unsigned char* tiff, size_t size) {
+            if (size < 8) return 0;
+            bool big_endian;
+            if (tiff[0] == 'M' && tiff[1] == 'M') big_endian = true;
+            else if (tiff[0] == 'I' && tiff[1] == 'I') big_endian = false;
+            else return 0;
+            if (read_u16(tiff + 2, big_endian) != 42) return 0;
+
+            unsigned long ifd = read_u32(tiff + 4, big_endian);
+            if (ifd + 2 > size) return 0;
+            unsigned entry_count = read_u16(tiff + ifd, big_endian);
+
+            for (unsigned i = 0; i < entry_count; i++) {
+                size_t entry = ifd + 2 + i * 12;   // tag(2) type(2) count(4) value(4)
+                if (entry + 12 > size) return 0;
+                if (read_u16(tiff + entry, big_endian) == 0x0112 && read_u16(tiff + entry + 2, big_endian) == 3)
+                    return read_u16(tiff + entry + 8, big_endian);   // SHORT, stored inline
+            }
+            return 0;
+        }
+
+        // RGB grids are small, their rotation is a plain pixel copy
+        void rotate_pixels(int orientation) {
+            const int ch = pixel_channels;
+            const int new_width = orientation == 3 ? width : height;
+            scratch.resize(image_data.size());
+            for (int r = 0; r < height; r++)
+                for (int c = 0; c < width; c++) {
+                    int dr = r, dc = c;
+                    if (orientation == 3) { dr = height - 1 - r; dc = width - 1 - c; }
+                    else if (orientation == 6) { dr = c; dc = height - 1 - r; }
+                    else if (orientation == 8) { dr = width - 1 - c; dc = r; }
+                    memcpy(scratch.data() + ((size_t)dr * new_width + dc) * ch, image_data.data() + ((size_t)r * width + c) * ch, ch);
+                }
+
+            image_data.swap(scratch);
+            if (orientation == 6 || orientation == 8)
+                swap(width, height);
+        }
+
+        void fix_orientation(int orientation) {
+            if (pixel_channels > 1 && (orientation == 3 || orientation == 6 || orientation == 8)) {
+                rotate_pixels(orientation);
+                return;
+            }
+            switch(orientation){
+                case 1: // normal
+                    break;
+                case 3: // rotated 180
+                    rotate180();
+                    break;
+                case 6:
+                    rotate90CW();
+                    break;
+                case 8:
+                    rotate90CCW();
+                    break;
+                default:
+                    break;
+            }
+
+        }
+
+        // orientation so we pick resizing ratio. Only header values are needed,
+        // so the grid is known before a single pixel is decoded
+        void plan_grid(int full_width, int full_height, int orientation) {
+            if (options.columns > 0 || options.rows > 0) {
+                plan_target_grid(full_width, full_height, orientation);
+                return;
+            }
+            float scale_x = 0.05f * options.grid_scale;
+            float scale_y = (full_height > full_width ? 0.017f : 0.024f) * options.grid_scale;   // FOR VERTICAL : FOR HORIZONTAL
+
+            if (orientation == 6 || orientation == 8)   // the grid is laid out upright
+                swap(full_width, full_height);
+
+            // so that minimum size of 1x1 is guaranteed
+            grid_width = max(static_cast<int>(full_width * scale_x), 1);
+            grid_height = max(static_cast<int>(full_height * scale_y), 1);
+        }
+
+        // --cols / --rows: the grid fits inside columns x rows whatever the input resolution,
+        // a missing side follows from the image aspect. A character is char_aspect times
+        // taller than wide, so a row covers that many more pixels than a column
+        void plan_target_grid(int full_width, int full_height, int orientation) {
+            if (orientation == 6 || orientation == 8)
+                swap(full_width, full_height);
+
+            double cells_per_pixel_x = 1e30;   // characters per source pixel, horizontally
+            if (options.columns > 0)
+                cells_per_pixel_x = (double)options.columns / full_width;
+            if (options.rows > 0)
+                cells_per_pixel_x = min(cells_per_pixel_x, (double)options.rows * options.char_aspect / full_height);
+
+            grid_width = max(static_cast<int>(lround(full_width * cells_per_pixel_x)), 1);
+            grid_height = max(static_cast<int>(lround(full_height * cells_per_pixel_x / options.char_aspect)), 1);
+            if (options.columns > 0) grid_width = min(grid_width, options.columns);   // rounding never overshoots the target
+            if (options.rows > 0) grid_height = min(grid_height, options.rows);
+        }
+
+        // samples per cell on each axis of the resized image, the sub-block of structure matching
+        int cell_samples_x() const {
+            switch (options.glyph_mode) {
+                case GlyphMode::Structure: return StructureAtlas::cell_width;
+                case GlyphMode::Quadrant:
+                case GlyphMode::Braille: return 2;
+                default: return 1;
+            }
+        }
+
+        int cell_samples_y() const {
+            switch (options.glyph_mode) {
+                case GlyphMode::Structure: return StructureAtlas::cell_height;
+                case GlyphMode::Quadrant: return 2;
+                case GlyphMode::Braille: return 4;
+                default: return 1;
+            }
+        }
+
+        // biggest JPEG decode scale (1, 2, 4, 8) that still leaves two decoded pixels per grid cell
+        // on both axes, or one per sample of a structure sub-block
+        int decode_denominator(int full_width, int full_height, int orientation) const {
+            if (orientation == 6 || orientation == 8)
+                swap(full_width, full_height);
+
+            int need_x = max(2, cell_samples_x()) * grid_width, need_y = max(2, cell_samples_y()) * grid_height;
+            int denom = 8;
+            while (denom > 1 && (full_width / denom < need_x || full_height / denom < need_y))
+                denom /= 2;
+            return denom;
+        }
+
+        // MAIN FUNCTIONS
+        void load_image(const string& img_path, int &img_width, int &img_height, int &channels, int desired_channel = GRAYSCALE){
+            MappedFile input(img_path);   // one mapping serves both the EXIF probe and the decoder
+            decode_image(input.data(), input.size(), img_width, img_height, channels, desired_channel);
+            filename = output_name(img_path);
+        }
+
+        int decode_channels() const {
+            return options.color == ColorMode::Off ? GRAYSCALE : 3;
+        }
+
+        // encoded bytes in memory -> image_data, grid planned
+        void decode_image(const unsigned char* bytes, size_t size, int &img_width, int &img_height, int &channels, int desired_channel = GRAYSCALE) {
+            if (size > INT_MAX) throw runtime_error("The image is too big");
+            int found;
+            {
+                TraceSpan span(options.tracer, "exif", size);
+                found = get_exif_orientation(bytes, size);
+            }
+            decode_pixels(bytes, size, found, img_width, img_height, channels, desired_channel);
+        }
+
+        // decode_image once the EXIF orientation is known
+        void decode_pixels(const unsigned char* bytes, size_t size, int exif_orientation, int &img_width, int &img_height,
+                           int &channels, int desired_channel) {
+            if (size > INT_MAX) throw runtime_error("The image is too big");
+            orientation = exif_orientation;
+            TraceSpan span(options.tracer, "decode", size);
+
+            if (!stbi_info_from_memory(bytes, size, &img_width, &img_height, &channels))
+                throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
+            plan_grid(img_width, img_height, orientation);
+
+            // JPEGs are shrunk inside the IDCT, the full resolution image never exists
+            int decoded_channels;
+            stbi_set_jpeg_scale_denom_thread(decode_denominator(img_width, img_height, orientation));
+            unsigned char* data = stbi_load_from_memory(bytes, size, &width, &height, &decoded_channels, desired_channel);
+            stbi_set_jpeg_scale_denom_thread(1);
+
+            if (!data)  throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
+            
+            pixel_channels = desired_channel;
+            size_t image_size = (size_t)width * height * pixel_channels;
+            image_data.adopt(data, image_size);   // take over the decoded pixels, no copy
+
+            // the orientation is fixed later, on the grid, where rotating costs almost nothing
+        }
+
+        // assign filename except first 5 and last 4 chars, for test/ and .jpg
+        static string output_name(const string& img_path) {
+            if (img_path.size() > 9)// avoid out of range
+                return img_path.substr(5, img_path.size() - 5 - 4);
+            return img_path; // fallback
+        }
+
+        // animations are text only, every other input gets its png unless --png off
+        bool writes_png(const string& img_path) const {
+            if (options.png == PngMode::Off) return false;
+            if (!options.animate) return true;
+            unsigned char header[6] = {};
+            ifstream input(img_path, ios::binary);
+            input.read(reinterpret_cast<char*>(header), sizeof(header));
+            return !GifDecoder::is_gif(header, input.gcount());
+        }
+
+        bool outputs_exist(const string& img_path) const {
+            string name = output_name(img_path);
+            return fs::exists("ascii/" + name) && (!writes_png(img_path) || fs::exists("out/" + name + ".png"));
+        }
+
+        void copy_outputs(const string& from_path, const string& to_path) const {
+            string from = output_name(from_path), to = output_name(to_path);
+            fs::copy_file("ascii/" + from, "ascii/" + to, fs::copy_options::overwrite_existing);
+            if (writes_png(from_path))
+                fs::copy_file("out/" + from + ".png", "out/" + to + ".png", fs::copy_options::overwrite_existing);
+        }
+
+        // everything that changes the output bytes. Bump the version when the rendering changes
+        uint64_t params_hash() const {
+            return hash_string("v1|" + palette + "|grid 0.05 0.017 0.024|scale " + to_string(options.grid_scale)
+                               + "|target " + to_string(options.columns) + "x" + to_string(options.rows) + " " + to_string(options.char_aspect)
+                               + "|color " + to_string(static_cast<int>(options.color)) + "|glyphs " + to_string(static_cast<int>(options.glyph_mode))
+                               + "|dither " + to_string(static_cast<int>(options.dither)) + "|png " + to_string(options.png != PngMode::Off)
+                               + "|animate " + to_string(options.animate) + "|backend " + to_string(static_cast<int>(options.png_backend)));
+        }
+
+        // planning with the cache: true when the outputs of img_path are already up to date.
+        // entry is filled in either way, so the caller can record it after converting
+        bool cached(const OutputCache& cache, const string& img_path, OutputCache::Entry& entry) const {
+            struct stat info;
+            if (stat(img_path.c_str(), &info) != 0) return false;
+            entry.size = info.st_size;
+            entry.mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+            entry.params = params_hash();
+
+            const OutputCache::Entry* known = cache.find(img_path);
+            bool same_params = known && known->params == entry.params;
+            if (same_params && known->size == entry.size && known->mtime == entry.mtime && outputs_exist(img_path)) {
+                entry.content = known->content;
+                return true;   // the cheap check, nothing is read
+            }
+
+            MappedFile input(img_path);
+            entry.content = hash_bytes(input.data(), input.size());
+            if (same_params && known->content == entry.content && outputs_exist(img_path))
+                return true;   // touched but unchanged
+
+            const string* twin = cache.find_content(entry.content, entry.params);
+            if (twin && *twin != img_path && outputs_exist(*twin)) {
+                copy_outputs(*twin, img_path);
+                return true;
+            }
+            return false;
+        }
+
+        bool save_image_as_png() {
+            TraceSpan span(options.tracer, "png", image_data.size());
+            string return_name = "out/" + filename + ".png";
+            if (png_writer) {
+                png_writer->push(return_name, width, height, pixel_channels, image_data.data());
+                return true;
+            }
+            return stbi_write_png(return_name.c_str(), width, height, pixel_channels, image_data.data(), width * pixel_channels) != 0;
+        }
+
+        // this resize used common factors, not so great
+        void resize_image(const int resize_factor) {  // resize factor is the next smallest common divisor between w and h. 1 is directly 1.
+            vector<int> possible_divisors = common_divisors(width, height);
+            int divisor;
+            if (resize_factor <= 0) divisor = 1;
+            else if (possible_divisors.size() <= resize_factor) divisor = possible_divisors[possible_divisors.size()-1];
+            else divisor = possible_divisors[resize_factor];
+
+            // at this point, we know the divisor. Need to group ant take the average value.
+            PixelBuffer& resized_image_data = scratch;
+            resized_image_data.resize(image_data.size() / (divisor*divisor));
+            int index = 0;
+
+            for (int row_p = 0; row_p < height; row_p = row_p + divisor)
+                for (int col_p = 0; col_p < width; col_p = col_p + divisor) {  // we use 2d addressing on a 1d array. Moving the pointer
+                    int sum = 0;
+                    for (int i = 0; i < divisor; i++)
+                        for (int j = 0; j < divisor; j++)
+                            sum += image_data[(row_p+i)*width + (col_p+j)];
+
+                    unsigned char avg = sum / (divisor*divisor);
+                    resized_image_data[index++] = avg;
+                }
+
+            image_data.swap(resized_image_data);
+            width = width / divisor;
+            height = height / divisor;
+        }
+
+        // new resize, uses nearest neighbour
+        void resize_image_nearest(float scale_x, float scale_y) {
+            resize_image_nearest_to(static_cast<int>(width * scale_x), static_cast<int>(height * scale_y));
+        }
+
+        // the image may already be decoded at a reduced size, so the target is given in pixels
+        void resize_image_nearest_to(int new_width, int new_height) {
+            // so that minimum size of 1x1 is guaranteed
+            new_width = max(new_width, 1);
+            new_height = max(new_height, 1);
+
+            float step_x = static_cast<float>(width) / new_width;
+            float step_y = static_cast<float>(height) / new_height;
+            PixelBuffer& resized_image_data = scratch;
+            resized_image_data.resize(new_width * new_height);
+
+            for (int row = 0; row < new_height; row++)
+                for (int col = 0; col < new_width; col++) {
+                    float orig_x = (col + 0.5f) * step_x;  // +0.5 for center sampling
+                    float orig_y = (row + 0.5f) * step_y;
+
+                    // Convert to integer coordinates
+                    int orig_x_int = static_cast<int>(orig_x);
+                    int orig_y_int = static_cast<int>(orig_y);
+
+                    orig_x_int = clamp(orig_x_int, 0, width - 1);
+                    orig_y_int = clamp(orig_y_int, 0, height - 1);
+
+                    resized_image_data[row * new_width + col] = image_data[orig_y_int * width + orig_x_int];
+                }
+
+            image_data.swap(resized_image_data);
+            width = new_width;
+            height = new_height;
+        }
+
+        // keeps every factor_x-th pixel of every factor_y-th row, the one nearest the middle of its block
+        void decimate(int factor_x, int factor_y) {
+            const int new_width = width / factor_x, new_height = height / factor_y;
+            const int ch = pixel_channels;
+            PixelBuffer& decimated = scratch;
+            decimated.resize((size_t)new_width * new_height * ch);
+            unsigned char* out = decimated.data();
+            for (int row = 0; row < new_height; row++) {
+                const unsigned char* in = image_data.data() + ((size_t)row * factor_y + factor_y / 2) * width * ch
+                                          + (size_t)(factor_x / 2) * ch;
+                if (ch == 1)
+                    for (int col = 0; col < new_width; col++, in += factor_x) *out++ = *in;
+                else
+                    for (int col = 0; col < new_width; col++, in += (size_t)factor_x * ch, out += ch) memcpy(out, in, ch);
+            }
+            image_data.swap(decimated);
+            width = new_width;
+            height = new_height;
+        }
+
+        // area average with arbitrary ratios: every source pixel contributes by how much of it
+        // falls into the output cell. Separable, rows first (SIMD), then columns on the row sums.
+        // Past area_taps source pixels per cell and axis the image is decimated first, so the
+        // average runs over 4 to 8 samples per axis and the cost follows the grid, not the image
+        void resize_image_area(int new_width, int new_height) {
+            new_width = max(new_width, 1);
+            new_height = max(new_height, 1);
+
+            const int area_taps = 4;
+            const int factor_x = max(width / (new_width * area_taps), 1), factor_y = max(height / (new_height * area_taps), 1);
+            if (factor_x > 1 || factor_y > 1)
+                decimate(factor_x, factor_y);
+
+            column_weights.build(width, new_width);
+            row_weights.build(height, new_height);
+            const int ch = pixel_channels;   // channels are interleaved, each one is averaged on its own
+            const size_t row_size = (size_t)width * ch;
+            row_sums.resize(row_size);
+
+            PixelBuffer& resized_image_data = scratch;
+            resized_image_data.resize((size_t)new_width * new_height * ch);
+            const uint64_t area = (uint64_t)width * height;   // weights add up to height and width
+            size_t wy = 0;
+
+            for (int row = 0; row < new_height; row++) {
+                fill(row_sums.begin(), row_sums.end(), 0);
+                for (int k = 0; k < row_weights.count[row]; k++)
+                    accumulate_weighted_row(row_sums.data(), image_data.data() + (row_weights.first[row] + k) * row_size,
+                                            row_weights.weights[wy++], row_size);
+
+                size_t wx = 0;
+                unsigned char* out = resized_image_data.data() + (size_t)row * new_width * ch;
+                for (int col = 0; col < new_width; col++) {
+                    const uint32_t* sums = row_sums.data() + (size_t)column_weights.first[col] * ch;
+                    for (int c = 0; c < ch; c++) {
+                        uint64_t sum = 0;
+                        for (int k = 0; k < column_weights.count[col]; k++)
+                            sum += (uint64_t)sums[k * ch + c] * column_weights.weights[wx + k];
+                        *out++ = (sum + area / 2) / area;
+                    }
+                    wx += column_weights.count[col];
+                }
+            }
+
+            image_data.swap(resized_image_data);
+            width = new_width;
+            height = new_height;
+        }
+
+        // ascii_form holds the whole text frame, newline after every row, ready to be written as is
+        void img_to_ascii() {
+            if (options.glyph_mode == GlyphMode::Structure) {
+                img_to_structure();
+                return;
+            }
+            if (options.glyph_mode == GlyphMode::Quadrant || options.glyph_mode == GlyphMode::Braille) {
+                img_to_unicode();
+                return;
+            }
+            if (pixel_channels == 3) {
+                img_to_ansi();
+                return;
+            }
+            const unsigned char* gray = glyph_input();
+            ascii_form.resize((size_t)(width + 1) * height);
+            for (int row = 0; row < height; row++) {
+                unsigned char* line = ascii_form.data() + (size_t)row * (width + 1);
+                glyphs.map(gray + (size_t)row * width, line, width);
+                line[width] = '\n';
+            }
+        }
+
+        // the brightness glyphs are chosen from: image_data itself, or the gray of its RGB in luma.
+        // With dithering it is always the copy in luma, the grid stays as resized for the png
+        const unsigned char* glyph_input() {
+            const size_t samples = (size_t)width * height;
+            dither_micros = 0;
+            if (pixel_channels == 1 && options.dither == DitherMode::Off) return image_data.data();
+            luma.resize(samples);
+            if (pixel_channels == 3)
+                rgb_to_gray(image_data.data(), luma.data(), samples);
+            else
+                memcpy(luma.data(), image_data.data(), samples);
+            if (options.dither != DitherMode::Off)
+                dither(luma.data());
+            return luma.data();
+        }
+
+        // between the resize and the glyph choice: the quantizer after it has as many levels as
+        // the palette has glyphs, or two for quadrants and braille where a sample is ink or not
+        void dither(unsigned char* gray) {
+            TraceSpan span(options.tracer, "dither", (size_t)width * height);
+            auto begin = chrono::steady_clock::now();
+            const bool unicode = options.glyph_mode == GlyphMode::Quadrant || options.glyph_mode == GlyphMode::Braille;
+            const int levels = unicode ? 2 : glyphs.size;
+            if (options.dither == DitherMode::Bayer)
+                dither_ordered(gray, width, height, levels);
+            else {
+                const unsigned threads = dither_threads();
+                if (threads > 1 && (!dither_team || dither_team->size() < threads))
+                    dither_team = make_unique<ThreadTeam>(threads);
+                dither_diffuse(gray, width, height, levels, options.dither == DitherMode::Atkinson, threads,
+                               threads > 1 ? dither_team.get() : nullptr, dither_errors);
+            }
+            dither_micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+        }
+
+        // wavefront threads for error diffusion. Only tall, big grids are worth the handoff to
+        // other threads; frame_threads is 1 wherever engines already run side by side
+        unsigned dither_threads() const {
+            if ((size_t)width * height < (1 << 18)) return 1;
+            unsigned threads = options.frame_threads ? options.frame_threads : max(thread::hardware_concurrency(), 1u);
+            return max(1u, min(threads, (unsigned)height / 16));
+        }
+
+        // biggest text frame of a columns x rows grid, exact without color except for quadrants
+        size_t max_frame_size(int columns, int rows) const {
+            size_t cells = (size_t)columns * rows;
+            bool unicode = options.glyph_mode == GlyphMode::Quadrant || options.glyph_mode == GlyphMode::Braille;
+            size_t glyph_size = unicode ? 3 : 1;   // quadrants and braille are all U+0800 - U+FFFF
+            if (options.color == ColorMode::Off) return cells * glyph_size + rows;
+            // longest escapes "\x1b[38;2;255;255;255m" and "\x1b[38;5;255m" before every glyph, plus the final reset
+            size_t escape_size = options.color == ColorMode::TrueColor ? 19 : 11;
+            return cells * (escape_size + glyph_size) + rows + 4;
+        }
+
+        void img_to_ansi() {
+            const size_t cells = (size_t)width * height;
+            const unsigned char* gray = glyph_input();   // luma, grown to cells first
+            glyphs.map(gray, luma.data(), cells);   // in place, one byte in for one out
+            emit_ansi(luma.data(), image_data.data(), width, height);
+        }
+
+        // structure matching on the sub-block image: every cell_samples_x x cell_samples_y block
+        // becomes the glyph of the closest shape, see StructureAtlas
+        void img_to_structure() {
+            dither_micros = 0;
+            const int sx = StructureAtlas::cell_width, sy = StructureAtlas::cell_height;
+            const int columns = width / sx, rows = height / sy;
+            const size_t samples = (size_t)width * height;
+            const unsigned char* gray = image_data.data();
+            if (pixel_channels == 3) {
+                luma.resize(samples);
+                rgb_to_gray(image_data.data(), luma.data(), samples);
+                gray = luma.data();
+            }
+
+            // the text frame needs rows more bytes than the cells, so the glyphs fit in it first
+            ascii_form.resize((size_t)(columns + 1) * rows);
+            unsigned char cell[StructureAtlas::cell_size];
+            for (int row = 0; row < rows; row++) {
+                unsigned char* line = ascii_form.data() + (size_t)row * (columns + 1);
+                for (int col = 0; col < columns; col++) {
+                    const unsigned char* block = gray + (size_t)row * sy * width + col * sx;
+                    for (int y = 0; y < sy; y++)
+                        memcpy(cell + y * sx, block + (size_t)y * width, sx);
+                    line[col] = atlas.match(cell);
+                }
+                line[columns] = '\n';
+            }
+            if (pixel_channels != 3) return;
+
+            // color: the glyphs move out of the way and every cell gets the mean of its block
+            PixelBuffer& cell_glyphs = scratch;
+            cell_glyphs.resize((size_t)columns * rows);
+            for (int row = 0; row < rows; row++)
+                memcpy(cell_glyphs.data() + (size_t)row * columns, ascii_form.data() + (size_t)row * (columns + 1), columns);
+            average_cells(sx, sy);
+            emit_ansi(cell_glyphs.data(), cell_colors.data(), columns, rows);
+        }
+
+        // cell_colors = mean RGB of every sx x sy block of image_data
+        void average_cells(int sx, int sy) {
+            const int columns = width / sx, rows = height / sy, samples = sx * sy;
+            cell_colors.resize((size_t)columns * rows * 3);
+            unsigned char* color = cell_colors.data();
+            for (int row = 0; row < rows; row++)
+                for (int col = 0; col < columns; col++)
+                    for (int c = 0; c < 3; c++) {
+                        const unsigned char* block = image_data.data() + ((size_t)row * sy * width + col * sx) * 3 + c;
+                        unsigned sum = 0;
+                        for (int y = 0; y < sy; y++)
+                            for (int x = 0; x < sx; x++)
+                                sum += block[((size_t)y * width + x) * 3];
+                        *color++ = (sum + samples / 2) / samples;
+                    }
+        }
+
+        // quadrant blocks or braille on the 2x2 or 2x4 sample image: a sample at or above half
+        // brightness is ink, the bits of a cell pick its character from unicode_cells
+        void img_to_unicode() {
+            const int sy = cell_samples_y(), columns = width / 2, rows = height / sy;
+            const size_t cells = (size_t)columns * rows;
+            const unsigned char* gray = glyph_input();
+
+            PixelBuffer& patterns = scratch;
+            patterns.resize(cells);
+            size_t blanks = 0;   // quadrant cells without ink are a one byte space
+            for (int row = 0; row < rows; row++) {
+                unsigned char* pattern = patterns.data() + (size_t)row * columns;
+                memset(pattern, 0, columns);
+                for (int y = 0; y < sy; y++) {
+                    const unsigned char* line = gray + ((size_t)row * sy + y) * width;
+                    int col = 0;
+#if defined(__SSE2__)
+                    // movemask gathers the top bits of 16 samples, the two of cell c land in bits 2c and 2c + 1
+                    for (; col + 8 <= columns; col += 8) {
+                        unsigned mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(line + col * 2)));
+                        for (int c = 0; c < 8; c++)
+                            pattern[col + c] |= (mask >> (2 * c) & 3) << (y * 2);
+                    }
+#endif
+                    for (; col < columns; col++)
+                        pattern[col] |= (line[col * 2] >> 7 | (line[col * 2 + 1] >> 7) << 1) << (y * 2);
+                }
+                for (int col = 0; col < columns; col++)
+                    blanks += pattern[col] == 0;
+            }
+
+            const UnicodeCells& table = unicode_cells(options.glyph_mode);
+            if (pixel_channels == 3) {
+                average_cells(2, sy);
+                emit_ansi(patterns.data(), cell_colors.data(), columns, rows, &table);
+                return;
+            }
+
+            // exact size, braille blanks are three bytes like every other pattern
+            size_t frame_size = cells * 3 + rows - (options.glyph_mode == GlyphMode::Quadrant ? blanks * 2 : 0);
+            ascii_form.resize(frame_size + 3);   // a cell is one 4 byte store, a blank quadrant uses 1 of them
+            unsigned char* out = ascii_form.data();
+            const unsigned char* pattern = patterns.data();
+            for (int row = 0; row < rows; row++) {
+                for (int col = 0; col < columns; col++, pattern++) {
+                    memcpy(out, table.bytes[*pattern], 4);
+                    out += table.size[*pattern];
+                }
+                *out++ = '\n';
+            }
+            ascii_form.resize(frame_size);
+        }
+
+        // colored frame: every glyph in the color of its cell, with an escape only where the
+        // color changes. Spaces keep whatever is set since their color is never seen. With
+        // unicode the cells are bit patterns and pattern 0 is the blank
+        void emit_ansi(const unsigned char* cell_glyphs, const unsigned char* rgb, int columns, int rows,
+                       const UnicodeCells* unicode = nullptr) {
+            const bool true_color = options.color != ColorMode::Palette256;
+            const Ansi256Table& table = ansi256_table();
+            ascii_form.resize(max_frame_size(columns, rows) + 1);   // + 1 for the 4 byte unicode store
+
+            unsigned char* out = ascii_form.data();
+            uint32_t current = UINT32_MAX;   // nothing set yet
+            for (int row = 0; row < rows; row++) {
+                for (int col = 0; col < columns; col++, rgb += 3) {
+                    unsigned char glyph = *cell_glyphs++;
+                    if (unicode ? glyph != 0 : glyph != ' ') {
+                        uint32_t color = true_color ? (uint32_t)rgb[0] << 16 | rgb[1] << 8 | rgb[2] : table.lookup(rgb);
+                        if (color != current) {
+                            memcpy(out, true_color ? "\x1b[38;2;" : "\x1b[38;5;", 7);
+                            out += 7;
+                            if (true_color) {
+                                out = put_decimal(out, rgb[0]);
+                                *out++ = ';';
+                                out = put_decimal(out, rgb[1]);
+                                *out++ = ';';
+                                out = put_decimal(out, rgb[2]);
+                            } else
+                                out = put_decimal(out, color);
+                            *out++ = 'm';
+                            current = color;
+                        }
+                    }
+                    if (unicode) {
+                        memcpy(out, unicode->bytes[glyph], 4);
+                        out += unicode->size[glyph];
+                    } else
+                        *out++ = glyph;
+                }
+                *out++ = '\n';
+            }
+            if (current != UINT32_MAX) {
+                memcpy(out, "\x1b[0m", 4);
+                out += 4;
+            }
+            ascii_form.resize(out - ascii_form.data());
+        }
+
+        void save_image_as_textf() {
+            {
+                TraceSpan span(options.tracer, "ascii", image_data.size());
+                img_to_ascii();
+            }
+            TraceSpan span(options.tracer, "text", ascii_form.size());
+            write_file("ascii/" + filename, ascii_form.data(), ascii_form.size());
+        }
+
+        // decoded image -> the grid, or its sub-blocks, still in the decoded orientation
+        void resize_to_grid() {
+            const int columns = grid_width * cell_samples_x(), rows = grid_height * cell_samples_y();
+            // the grid is upright, the decoded image is not rotated yet
+            if (orientation == 6 || orientation == 8)
+                resize_image_area(rows, columns);
+            else
+                resize_image_area(columns, rows);
+        }
+
+        // decoded image -> upright grid
+        void fit_to_grid() {
+            {
+                TraceSpan span(options.tracer, "resize", image_data.size());
+                resize_to_grid();
+            }
+            TraceSpan span(options.tracer, "orientation", image_data.size());
+            fix_orientation(orientation);
+        }
+
+        // header only: dimensions, format and orientation. The input is mapped, so only
+        // the pages holding the header are actually read
+        void probe_image(const string& img_path, ImageJob& job) {
+            MappedFile input(img_path);
+            job.path = img_path;
+            job.orientation = get_exif_orientation(input.data(), input.size());
+            if (!stbi_info_from_memory(input.data(), input.size(), &job.width, &job.height, &job.channels))
+                throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
+
+            job.is_jpeg = input.size() > 2 && input.data()[0] == 0xFF && input.data()[1] == 0xD8;
+            size_t pixels = (size_t)job.width * job.height;
+            if (job.is_jpeg) {   // JPEGs are decoded at a reduced size, see load_image
+                plan_grid(job.width, job.height, job.orientation);
+                int denom = decode_denominator(job.width, job.height, job.orientation);
+                pixels /= denom * denom;
+            }
+            job.cost = input.size() + pixels;
+        }
+
+        // gray frame -> text frame in ascii_form. The pixels are swapped in, pixels gets
+        // back a spare buffer for the next frame
+        void convert_frame(PixelBuffer& pixels, int frame_width, int frame_height) {
+            image_data.swap(pixels);
+            width = frame_width;
+            height = frame_height;
+            orientation = 0;
+            pixel_channels = 1;
+            plan_grid(width, height, orientation);
+            fit_to_grid();
+            img_to_ascii();
+        }
+
+        // every frame of a GIF into one text stream, each frame under a "frame <index> <delay> ms"
+        // line. A frame identical to the one before it only adds its delay to that one.
+        // Frames are decoded in order and converted by frame_threads engines, at most
+        // max_in_flight decoded frames exist at any time
+        void animation_pipeline(const string& img_path, const MappedFile& input) {
+            struct Frame {
+                PixelBuffer pixels;
+                int delay = 0;
+                size_t index = 0;
+                vector<unsigned char> text;
+                bool done = false;
+                string error;
+            };
+
+            GifDecoder gif(input.data(), input.size());
+            filename = output_name(img_path);
+            int fd = open(("ascii/" + filename).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) throw runtime_error("Failed to create the file: ascii/" + filename);
+
+            // the frame waiting for its successor, which decides whether it grows or is written
+            Frame pending;
+            bool have_pending = false;
+            size_t written = 0, frame_count = 0;
+            auto write_pending = [&]() {
+                string header = "frame " + to_string(pending.index) + " " + to_string(pending.delay) + " ms\n";
+                write_all(fd, reinterpret_cast<const unsigned char*>(header.data()), header.size());
+                write_all(fd, pending.text.data(), pending.text.size());
+                written++;
+            };
+            auto emit = [&](Frame& frame) {   // frames arrive here in order
+                if (!frame.error.empty()) throw runtime_error(frame.error);
+                frame_count++;
+                if (have_pending && frame.text == pending.text) {
+                    pending.delay += frame.delay;
+                    return;
+                }
+                if (have_pending) write_pending();
+                swap(pending.text, frame.text);
+                pending.delay = frame.delay;
+                pending.index = frame.index;
+                have_pending = true;
+            };
+
+            unsigned thread_count = options.frame_threads ? options.frame_threads : max(thread::hardware_concurrency(), 1u);
+            const size_t max_in_flight = 2 * thread_count;
+            vector<Engine> engines;
+            vector<thread> workers;
+            mutex lock;
+            condition_variable changed;
+            deque<unique_ptr<Frame>> window;   // decoded and not written yet, in frame order
+            deque<Frame*> todo;
+            bool finished = false;
+
+            auto stop_workers = [&]() {
+                {
+                    lock_guard<mutex> guard(lock);
+                    finished = true;
+                    todo.clear();
+                }
+                changed.notify_all();
+                for (thread& worker : workers) worker.join();
+                workers.clear();
+            };
+
+            // writes the finished frames at the front of the window. With drain it waits
+            // for all of them, otherwise only until there is room for one more frame
+            auto flush = [&](bool drain) {
+                unique_lock<mutex> guard(lock);
+                while (!window.empty()) {
+                    if (!window.front()->done) {
+                        if (!drain && window.size() < max_in_flight) return;
+                        changed.wait(guard);
+                        continue;
+                    }
+                    unique_ptr<Frame> frame = move(window.front());
+                    window.pop_front();
+                    guard.unlock();
+                    emit(*frame);
+                    guard.lock();
+                }
+            };
+
+            try {
+                if (thread_count > 1) {
+                    PipelineOptions worker_options = options;
+                    worker_options.png = PngMode::Off;
+                    worker_options.frame_threads = 1;   // the frames already run side by side
+                    engines.reserve(thread_count);
+                    for (unsigned i = 0; i < thread_count; i++) {
+                        engines.emplace_back(worker_options);
+                        engines.back().configure(palette, options.grid_scale);
+                    }
+                    for (unsigned i = 0; i < thread_count; i++)
+                        workers.emplace_back([&, i]() {
+                            unique_lock<mutex> guard(lock);
+                            while (true) {
+                                changed.wait(guard, [&]() { return finished || !todo.empty(); });
+                                if (todo.empty()) return;
+                                Frame* frame = todo.front();
+                                todo.pop_front();
+                                guard.unlock();
+                                try {
+                                    engines[i].convert_frame(frame->pixels, gif.width(), gif.height());
+                                    swap(frame->text, engines[i].ascii_form);
+                                } catch (const exception& e) {
+                                    frame->error = e.what();
+                                }
+                                guard.lock();
+                                frame->done = true;
+                                changed.notify_all();
+                            }
+                        });
+                }
+
+                PixelBuffer spare;   // comes back from convert_frame in the single thread case
+                for (size_t index = 0; ; index++) {
+                    auto frame = make_unique<Frame>();
+                    frame->index = index;
+                    if (thread_count == 1) {
+                        if (!gif.next(spare, frame->delay)) break;
+                        convert_frame(spare, gif.width(), gif.height());
+                        frame->text = ascii_form;
+                        emit(*frame);
+                        continue;
+                    }
+
+                    flush(false);
+                    if (!gif.next(frame->pixels, frame->delay)) break;
+                    lock_guard<mutex> guard(lock);
+                    todo.push_back(frame.get());
+                    window.push_back(move(frame));
+                    changed.notify_all();
+                }
+                flush(true);
+                stop_workers();
+                if (have_pending) write_pending();
+            } catch (...) {
+                stop_workers();
+                close(fd);
+                throw;
+            }
+            close(fd);
+            log_line(cout, "Created file: " + filename + " (" + to_string(written) + " of " + to_string(frame_count) + " frames)");
+        }
+
+    public:
+        explicit Engine(const PipelineOptions& options = {}) : options(options) {
+            configure(options.palette, options.grid_scale);
+            check_options(options);
+            if (options.png == PngMode::Async)
+                png_writer = make_shared<PngWriterQueue>();
+        }
+
+        void ascii_pipeline(string img_path){
+            if (options.animate) {
+                MappedFile input(img_path);
+                if (GifDecoder::is_gif(input.data(), input.size())) {
+                    animation_pipeline(img_path, input);
+                    return;
+                }
+            }
+
+            TraceSpan span(options.tracer, "image");
+            span.detail = img_path;
+            int width, height, channels;
+            load_image(img_path, width, height, channels, decode_channels());
+            span.bytes = image_data.size();
+            fit_to_grid();
+            
+            if (options.png != PngMode::Off)
+                save_image_as_png();
+            save_image_as_textf();
+            log_line(cout, "Created file: " + filename);
+        }
+
+        // palette and scale for the following images, an empty palette is the built in one
+        void configure(const string& new_palette, float grid_scale) {
+            const string& chosen = new_palette.empty() ? default_palette : new_palette;
+            if (chosen.size() > 256) throw runtime_error("The palette can have at most 256 characters");
+            if (!(grid_scale > 0 && grid_scale <= 16)) throw runtime_error("The scale must be above 0 and at most 16");
+            if (chosen != palette) {
+                palette = chosen;
+                glyphs.build(palette);
+                atlas = StructureAtlas();
+            }
+            if (options.glyph_mode == GlyphMode::Structure && atlas.empty())
+                atlas.build(palette == default_palette ? string() : palette);   // the built in palette means the whole font
+            options.grid_scale = grid_scale;
+        }
+
+        // encoded image in memory -> text frame, no files are touched. The frame stays
+        // valid until the next call on this engine
+        const vector<unsigned char>& convert_memory(const unsigned char* bytes, size_t size) {
+            int full_width, full_height, channels;
+            decode_image(bytes, size, full_width, full_height, channels, decode_channels());
+            fit_to_grid();
+            img_to_ascii();
+            return ascii_form;
+        }
+
+        static void check_options(const PipelineOptions& options) {
+            if (options.columns < 0 || options.columns > 10000 || options.rows < 0 || options.rows > 10000)
+                throw runtime_error("The columns and rows must be between 0 (no limit) and 10000");
+            if (!(options.char_aspect > 0 && options.char_aspect <= 16))
+                throw runtime_error("The character aspect must be above 0 and at most 16");
+            if (options.dither != DitherMode::Off && options.glyph_mode == GlyphMode::Structure)
+                throw runtime_error("Dithering works with the brightness, quadrant and braille glyphs");
+            if (options.animate && options.color != ColorMode::Off)
+                throw runtime_error("Animations are converted in gray, --color does not work with --animate");
+        }
+
+        // per call settings of ascii_convert
+        void apply(const PipelineOptions& call_options) {
+            options.glyph_mode = call_options.glyph_mode;
+            configure(call_options.palette, call_options.grid_scale);
+            check_options(call_options);
+            options.columns = call_options.columns;
+            options.rows = call_options.rows;
+            options.char_aspect = call_options.char_aspect;
+            options.dither = call_options.dither;
+            options.color = call_options.color;
+            options.tracer = call_options.tracer;
+        }
+
+        // header only: the frame size convert_memory will need at most
+        size_t frame_capacity(const unsigned char* bytes, size_t size) {
+            int full_width, full_height, channels;
+            if (size > INT_MAX || !stbi_info_from_memory(bytes, size, &full_width, &full_height, &channels))
+                throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
+            plan_grid(full_width, full_height, get_exif_orientation(bytes, size));
+            return max_frame_size(grid_width, grid_height);
+        }
+
+        // the grid of the last convert_memory as a PNG file in memory
+        void encode_png(PixelBuffer& png) {
+            int png_size;
+            unsigned char* data = stbi_write_png_to_mem(image_data.data(), width * pixel_channels, width, height, pixel_channels, &png_size);
+            if (!data) throw runtime_error("Failed to encode the png");
+            png.adopt(data, png_size);
+        }
+
+        // one image in on in_fd, its text frame out on out_fd, no files are touched
+        void stream_pipeline(int in_fd, int out_fd) {
+            StreamReader reader(in_fd, 64 << 10);
+            orientation = get_exif_orientation(reader.header(), reader.header_size());
+
+            // the grid can only be planned ahead when the frame header is inside the probed bytes
+            int full_width, full_height, channels, denom = 1;
+            bool planned = stbi_info_from_memory(reader.header(), reader.header_size(), &full_width, &full_height, &channels);
+            if (planned) {
+                plan_grid(full_width, full_height, orientation);
+                denom = decode_denominator(full_width, full_height, orientation);
+            }
+
+            stbi_set_jpeg_scale_denom_thread(denom);
+            unsigned char* data = stbi_load_from_callbacks(&reader.callbacks, &reader, &width, &height, &channels, decode_channels());
+            stbi_set_jpeg_scale_denom_thread(1);
+            if (!data)  throw runtime_error("Failed to  load the image given: " + string(stbi_failure_reason()));
+
+            pixel_channels = decode_channels();
+            image_data.adopt(data, (size_t)width * height * pixel_channels);
+            if (!planned)
+                plan_grid(width, height, orientation);
+            fit_to_grid();
+
+            img_to_ascii();
+            write_all(out_fd, ascii_form.data(), ascii_form.size());
+        }
+
+        // raw frames of frame_width x frame_height with 1 (gray8) or 3 (RGB24) channels on in_fd
+        // until it ends, each one rendered to out_fd. A reader thread keeps pulling frames while
+        // one is rendered; when rendering falls behind, the oldest waiting frame is dropped
+        void video_pipeline(int in_fd, int out_fd, int frame_width, int frame_height, int channels, bool timings) {
+            if (frame_width <= 0 || frame_height <= 0 || (channels != 1 && channels != 3))
+                throw runtime_error("Invalid video format");
+            if (channels == 1 && options.color != ColorMode::Off)
+                throw runtime_error("Colored video needs --pixel rgb24");
+            const size_t frame_pixels = (size_t)frame_width * frame_height;
+            FrameRing ring(4, frame_pixels * channels);
+            string read_error;
+
+            thread reader([&]() {
+                try {
+                    pollfd watch = { in_fd, POLLIN, 0 };
+                    while (!ring.is_closed()) {
+                        int ready = poll(&watch, 1, 100);   // wakes up now and then, so a failed renderer can stop it
+                        if (ready < 0 && errno != EINTR) throw runtime_error(string("Failed to read: ") + strerror(errno));
+                        if (ready <= 0) continue;
+                        if (!read_all(in_fd, ring.reader_frame().data(), frame_pixels * channels)) break;
+                        ring.publish();
+                    }
+                } catch (const exception& e) {
+                    read_error = e.what();
+                }
+                ring.close();
+            });
+
+            // on a terminal every frame is drawn over the last one
+            const bool terminal = isatty(out_fd);
+            const unsigned char clear_screen[] = "\x1b[2J", cursor_home[] = "\x1b[H";
+            LatencyHistogram convert_times, resize_times, dither_times, ascii_times, write_times;
+            uint64_t shown = 0;
+            auto started = chrono::steady_clock::now();
+            auto micros = [](chrono::steady_clock::time_point from, chrono::steady_clock::time_point to) {
+                return (uint64_t)chrono::duration_cast<chrono::microseconds>(to - from).count();
+            };
+
+            try {
+                if (terminal) write_all(out_fd, clear_screen, sizeof(clear_screen) - 1);
+                size_t slot;
+                while (ring.next(slot)) {
+                    auto begin = chrono::steady_clock::now();
+                    PixelBuffer& frame = ring.frame(slot);
+                    if (channels == 3 && options.color == ColorMode::Off) {
+                        image_data.resize(frame_pixels);
+                        rgb_to_gray(frame.data(), image_data.data(), frame_pixels);
+                    } else
+                        image_data.swap(frame);   // the ring gets the old buffer back
+                    ring.release(slot);
+                    width = frame_width;
+                    height = frame_height;
+                    orientation = 0;
+                    pixel_channels = options.color == ColorMode::Off ? 1 : 3;
+                    plan_grid(width, height, orientation);
+                    auto converted = chrono::steady_clock::now();
+
+                    fit_to_grid();
+                    auto resized = chrono::steady_clock::now();
+                    img_to_ascii();
+                    auto quantized = chrono::steady_clock::now();
+                    if (terminal) write_all(out_fd, cursor_home, sizeof(cursor_home) - 1);
+                    write_all(out_fd, ascii_form.data(), ascii_form.size());
+                    auto written = chrono::steady_clock::now();
+
+                    convert_times.record(micros(begin, converted));
+                    resize_times.record(micros(converted, resized));
+                    dither_times.record(dither_micros);   // measured inside img_to_ascii
+                    ascii_times.record(micros(resized, quantized) - dither_micros);
+                    write_times.record(micros(quantized, written));
+                    if (timings) {
+                        char line[160];
+                        snprintf(line, sizeof(line), "frame %llu convert %.3f resize %.3f dither %.3f ascii %.3f write %.3f ms",
+                                 (unsigned long long)shown, micros(begin, converted) / 1000.0, micros(converted, resized) / 1000.0,
+                                 dither_micros / 1000.0, (micros(resized, quantized) - dither_micros) / 1000.0, micros(quantized, written) / 1000.0);
+                        log_line(cerr, line);
+                    }
+                    shown++;
+                }
+            } catch (...) {
+                ring.close();
+                reader.join();
+                throw;
+            }
+            reader.join();
+            if (!read_error.empty()) throw runtime_error(read_error);
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            char summary[512];
+            int length = snprintf(summary, sizeof(summary), "Rendered %llu frames, %llu dropped, %.1f fps\n",
+                                  (unsigned long long)shown, (unsigned long long)ring.dropped_frames(), seconds > 0 ? shown / seconds : 0.0);
+            const pair<const char*, const LatencyHistogram*> stages[] = {
+                {"convert", &convert_times}, {"resize", &resize_times}, {"dither", &dither_times}, {"ascii", &ascii_times},
+                {"write", &write_times} };
+            for (const auto& stage : stages)
+                length += snprintf(summary + length, sizeof(summary) - length, "%-8s p50 %.3f ms  p99 %.3f ms\n", stage.first,
+                                   stage.second->percentile(0.50) / 1000, stage.second->percentile(0.99) / 1000);
+            summary[length - 1] = '\0';   // log_line ends the line
+            log_line(cerr, summary);
+        }
+
+        // --bench: every stage of the pipeline over the generated corpus on this thread, the
+        // median of the iterations per stage. JSON on stdout, a readable table on stderr
+        void benchmark(unsigned iterations) {
+            iterations = max(iterations, 1u);
+            vector<BenchImage> corpus = make_bench_corpus();
+            char dir_template[] = "/tmp/ascii_bench_XXXXXX";
+            if (!mkdtemp(dir_template)) throw runtime_error("Failed to create a directory for the benchmark");
+            const string dir = dir_template;
+
+            static const char* stage_names[] = {"exif", "decode", "resize", "orientation", "dither", "ascii", "png", "text"};
+            const int stage_count = 8;
+#if defined(__AVX2__)
+            const char* simd = "avx2";
+#elif defined(__SSSE3__)
+            const char* simd = "ssse3";
+#elif defined(__SSE2__)
+            const char* simd = "sse2";
+#else
+            const char* simd = "scalar";
+#endif
+            const char* backends[] = {"builtin", "store", "fast", "zlib", "libdeflate"};
+            const char* glyph_names[] = {"brightness", "structure", "quadrant", "braille"};
+            const char* dither_names[] = {"off", "floyd", "atkinson", "bayer"};
+            string json = string("{\n  \"schema\": 1,\n  \"compiler\": \"") + __VERSION__ + "\",\n  \"simd\": \"" + simd
+                          + "\",\n  \"png_backend\": \"" + backends[static_cast<int>(png_backend)] + "\",\n  \"color\": "
+                          + to_string(static_cast<int>(options.color)) + ",\n  \"glyphs\": \""
+                          + glyph_names[static_cast<int>(options.glyph_mode)] + "\",\n  \"dither\": \""
+                          + dither_names[static_cast<int>(options.dither)] + "\",\n  \"iterations\": " + to_string(iterations)
+                          + ",\n  \"images\": [\n";
+            string table = "image                    grid      decode  resize  orient  dither   ascii     png    text   total ms   MP/s\n";
+            double corpus_seconds = 0, corpus_megapixels = 0;
+            uint64_t corpus_heap = 0, corpus_reused = 0;
+
+            for (size_t n = 0; n < corpus.size(); n++) {
+                const BenchImage& image = corpus[n];
+                const string text_path = dir + "/" + image.name + ".txt", png_path = dir + "/" + image.name + ".png";
+                vector<double> times[stage_count];
+                uint64_t heap_before = BufferPool::heap_allocations, reused_before = BufferPool::reused_allocations;
+
+                for (unsigned it = 0; it < iterations; it++) {
+                    double stage[stage_count];
+                    auto mark = chrono::steady_clock::now();
+                    auto lap = [&](int index) {
+                        auto now = chrono::steady_clock::now();
+                        stage[index] = chrono::duration<double, milli>(now - mark).count();
+                        mark = now;
+                    };
+
+                    int found = get_exif_orientation(image.bytes.data(), image.bytes.size());
+                    lap(0);
+                    int full_width, full_height, channels;
+                    decode_pixels(image.bytes.data(), image.bytes.size(), found, full_width, full_height, channels, decode_channels());
+                    lap(1);
+                    resize_to_grid();
+                    lap(2);
+                    fix_orientation(orientation);
+                    lap(3);
+                    img_to_ascii();
+                    lap(5);
+                    stage[4] = dither_micros / 1000.0;   // timed inside img_to_ascii
+                    stage[5] -= stage[4];
+                    if (!stbi_write_png(png_path.c_str(), width, height, pixel_channels, image_data.data(), width * pixel_channels))
+                        throw runtime_error("Failed to write " + png_path);
+                    lap(6);
+                    write_file(text_path, ascii_form.data(), ascii_form.size());
+                    lap(7);
+
+                    for (int i = 0; i < stage_count; i++)
+                        times[i].push_back(stage[i]);
+                }
+                uint64_t heap = BufferPool::heap_allocations - heap_before, reused = BufferPool::reused_allocations - reused_before;
+                unlink(text_path.c_str());
+                unlink(png_path.c_str());
+
+                double median[stage_count], total = 0;
+                for (int i = 0; i < stage_count; i++) {
+                    nth_element(times[i].begin(), times[i].begin() + iterations / 2, times[i].end());
+                    median[i] = times[i][iterations / 2];
+                    total += median[i];
+                }
+                double megapixels = (double)image.width * image.height / 1e6;
+                corpus_seconds += total / 1000;
+                corpus_megapixels += megapixels;
+                corpus_heap += heap;
+                corpus_reused += reused;
+
+                char line[512];
+                snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"orientation\": %d, \"bytes\": %zu, "
+                         "\"grid\": [%d, %d], \"ms\": {", image.name.c_str(), image.width, image.height, image.orientation,
+                         image.bytes.size(), grid_width, grid_height);
+                json += line;
+                for (int i = 0; i < stage_count; i++) {
+                    snprintf(line, sizeof(line), "%s\"%s\": %.4f", i ? ", " : "", stage_names[i], median[i]);
+                    json += line;
+                }
+                snprintf(line, sizeof(line), "}, \"total_ms\": %.4f, \"mp_per_s\": %.2f, \"heap_allocations\": %llu, \"pool_allocations\": %llu}%s\n",
+                         total, megapixels / (total / 1000), (unsigned long long)heap, (unsigned long long)reused,
+                         n + 1 < corpus.size() ? "," : "");
+                json += line;
+
+                snprintf(line, sizeof(line), "%-22s %4dx%-4d %7.2f %7.2f %7.3f %7.3f %7.3f %7.2f %7.3f %10.2f %6.1f\n", image.name.c_str(),
+                         grid_width, grid_height, median[1], median[2], median[3], median[4], median[5], median[6], median[7], total,
+                         megapixels / (total / 1000));
+                table += line;
+            }
+            rmdir(dir.c_str());
+
+            char line[256];
+            snprintf(line, sizeof(line), "  ],\n  \"images_per_s\": %.2f,\n  \"mp_per_s\": %.2f,\n  \"heap_allocations\": %llu,\n"
+                     "  \"pool_allocations\": %llu\n}\n", corpus.size() / corpus_seconds, corpus_megapixels / corpus_seconds,
+                     (unsigned long long)corpus_heap, (unsigned long long)corpus_reused);
+            json += line;
+            snprintf(line, sizeof(line), "%.2f images/s, %.1f MP/s, %llu heap allocations, %llu served from the pool",
+                     corpus.size() / corpus_seconds, corpus_megapixels / corpus_seconds,
+                     (unsigned long long)corpus_heap, (unsigned long long)corpus_reused);
+            table += line;
+
+            log_line(cerr, table);
+            write_all(STDOUT_FILENO, reinterpret_cast<const unsigned char*>(json.data()), json.size());
+        }
+
+        // thread_count 0 means one worker per hardware thread
+        void batch_ascii(string folder_path, unsigned thread_count = 0){
+            cout << "Scanning the folder: " << folder_path << endl; 
+            std::vector<std::string> files;
+                for (const auto& entry : fs::directory_iterator(folder_path)) 
+                    if (entry.is_regular_file()) 
+                        files.push_back(entry.path().string());  
+
+            if (files.empty()) return;
+            if (thread_count == 0) thread_count = max(thread::hardware_concurrency(), 1u);
+            thread_count = min<size_t>(thread_count, files.size());
+
+            // every worker gets its own engine, so image_data, width, height and filename are never shared
+            vector<Engine> engines;
+            engines.reserve(thread_count);
+            for (unsigned i = 0; i < thread_count; i++) {
+                PipelineOptions worker_options = options;
+                worker_options.png = options.png == PngMode::Async ? PngMode::Sync : options.png;
+                worker_options.frame_threads = 1;   // the batch already keeps every thread busy
+                engines.emplace_back(worker_options);
+                if (png_writer) engines.back().png_writer = png_writer;   // one queue for the whole batch
+            }
+
+            unique_ptr<OutputCache> cache;
+            vector<OutputCache::Entry> cache_entries(files.size());
+            vector<char> done(files.size(), 0);   // converted now, or already up to date
+            if (options.cache) {
+                cache = make_unique<OutputCache>(".ascii_cache");
+                cache->load();
+            }
+
+            // planning pass: read every header, drop what can not be decoded before any work is spent on it
+            vector<ImageJob> jobs(files.size());
+            vector<char> usable(files.size(), 0);
+            atomic<size_t> reused{0};
+            WorkStealingPool planner(thread_count);
+            for (size_t i = 0; i < files.size(); i++)
+                planner.push(i % thread_count, i);
+            planner.run([&](unsigned worker, size_t task) {
+                try {
+                    if (cache && engines[worker].cached(*cache, files[task], cache_entries[task])) {
+                        done[task] = 1;
+                        reused++;
+                        return;
+                    }
+                    TraceSpan span(options.tracer, "plan");
+                    engines[worker].probe_image(files[task], jobs[task]);
+                    usable[task] = 1;
+                } catch (const exception& e) {
+                    log_line(cerr, "Skipped " + files[task] + ": " + e.what());
+                }
+            });
+
+            vector<size_t> order;
+            for (size_t i = 0; i < files.size(); i++)
+                if (usable[i]) order.push_back(i);
+            // cheapest first, so the back of every deque (where its owner pops) holds its biggest
+            // images and the small ones at the front are what thieves take near the end
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return jobs[a].cost < jobs[b].cost; });
+
+            WorkStealingPool pool(thread_count);
+            for (size_t i = 0; i < order.size(); i++)
+                pool.push(i % thread_count, order[i]);
+
+            atomic<size_t> converted{0};
+            pool.run([&](unsigned worker, size_t task) {
+                try {
+                    engines[worker].ascii_pipeline(files[task]);
+                    done[task] = 1;
+                    converted++;
+                } catch (const exception& e) {
+                    log_line(cerr, "Skipped " + files[task] + ": " + e.what());
+                }
+            });
+
+            if (cache) {
+                for (size_t i = 0; i < files.size(); i++)
+                    if (done[i]) cache->record(files[i], cache_entries[i]);
+                cache->save();
+                log_line(cout, "Reused " + to_string(reused) + " files from the cache");
+            }
+
+            // heap allocations stop growing once every worker has seen its biggest image
+            log_line(cout, "Converted " + to_string(converted) + " of " + to_string(files.size()) + " files, "
+                           + to_string(BufferPool::heap_allocations) + " buffer allocations, "
+                           + to_string(BufferPool::reused_allocations) + " served from the pool");
+            if (options.tracer)
+                log_line(cout, options.tracer->summary());
+        }
+};
+
+namespace {
+
+// Server protocol, host byte order since both ends are on the same machine. A request is
+// the header, palette_size palette bytes and image_size image bytes. The answer is the
+// header, the text frame (or the error message) and the png. A connection carries any
+// number of requests, answered in order
+const uint32_t request_magic = 0x51413241;   // "A2AQ"
+
+enum RequestFlags : uint32_t { WANT_TEXT = 1, WANT_PNG = 2, WANT_STATS = 4 };
+
+struct RequestHeader {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t scale_milli;   // grid scale * 1000, 0 for the server default
+    uint32_t palette_size;   // 0 for the server default
+    uint64_t image_size;
+};
+
+struct ResponseHeader {
+    uint32_t status;   // 0 ok, otherwise the text is the error message
+    uint32_t reserved;
+    uint64_t text_size;
+    uint64_t png_size;
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+sockaddr_un socket_address(const string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) throw runtime_error("Socket path too long: " + socket_path);
+    strcpy(address.sun_path, socket_path.c_str());
+    return address;
+}
+
+int connect_socket(const string& socket_path) {
+    sockaddr_un address = socket_address(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw runtime_error(string("Failed to create the socket: ") + strerror(errno));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        throw runtime_error("Failed to connect to " + socket_path + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+// Long running mode: worker threads with warm engines (decode buffers, glyph tables and
+// buffer pools survive from request to request) serve clients on a Unix domain socket
+class AsciiServer {
+    private:
+        const size_t max_image_size = size_t(256) << 20;
+
+        string socket_path;
+        PipelineOptions options;   // defaults for requests that leave palette or scale out
+        unsigned thread_count;
+        int listen_fd = -1;
+
+        // Connections between requests sit in the poll loop of run, not in a worker: a readable
+        // one goes to ready, a worker answers one request and hands it back through returned,
+        // waking the poll loop with a byte on wake_pipe
+        mutex lock;   // guards ready, returned and the statistics
+        condition_variable has_connection;
+        deque<int> ready;
+        vector<int> returned;
+        int wake_pipe[2] = {-1, -1};
+        LatencyHistogram latencies;
+        uint64_t failed = 0;
+        chrono::steady_clock::time_point started;
+
+        void send_response(int fd, uint32_t status, const unsigned char* text, size_t text_size,
+                           const unsigned char* png, size_t png_size) {
+            ResponseHeader header = { status, 0, text_size, png_size };
+            write_all(fd, reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+            write_all(fd, text, text_size);
+            write_all(fd, png, png_size);
+        }
+
+        // one request of a readable connection, false when the client has closed it
+        bool serve_request(ToAscii::Engine& engine, int fd, vector<unsigned char>& request, PixelBuffer& png) {
+            RequestHeader header;
+            if (!read_all(fd, reinterpret_cast<unsigned char*>(&header), sizeof(header)))
+                return false;
+
+            if (header.magic != request_magic || header.palette_size > 256 || header.image_size > max_image_size)
+                throw runtime_error("Malformed request");
+            request.resize(header.palette_size + header.image_size);
+            if (!request.empty() && !read_all(fd, request.data(), request.size()))
+                throw runtime_error("Unexpected end of stream");
+
+            if (header.flags & WANT_STATS) {
+                string report = stats();
+                send_response(fd, 0, reinterpret_cast<const unsigned char*>(report.data()), report.size(), nullptr, 0);
+                return true;
+            }
+
+            auto begin = chrono::steady_clock::now();
+            uint32_t status = 0;
+            string error;
+            const vector<unsigned char>* text = nullptr;
+            size_t png_size = 0;
+            try {
+                string palette(request.begin(), request.begin() + header.palette_size);
+                engine.configure(palette.empty() ? options.palette : palette,
+                                 header.scale_milli ? header.scale_milli / 1000.0f : options.grid_scale);
+                text = &engine.convert_memory(request.data() + header.palette_size, header.image_size);
+                if (header.flags & WANT_PNG) {
+                    engine.encode_png(png);
+                    png_size = png.size();
+                }
+            } catch (const exception& e) {
+                status = 1;
+                error = e.what();
+            }
+            uint64_t elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+            {
+                lock_guard<mutex> guard(lock);
+                latencies.record(elapsed);
+                failed += status != 0;
+            }
+
+            if (status != 0)
+                send_response(fd, status, reinterpret_cast<const unsigned char*>(error.data()), error.size(), nullptr, 0);
+            else if (header.flags & WANT_TEXT)
+                send_response(fd, 0, text->data(), text->size(), png.data(), png_size);
+            else
+                send_response(fd, 0, nullptr, 0, png.data(), png_size);
+            return true;
+        }
+
+        void worker_loop() {
+            PipelineOptions worker_options = options;
+            worker_options.png = PngMode::Off;   // the png, when asked for, goes back over the socket
+            worker_options.frame_threads = 1;
+            ToAscii::Engine engine(worker_options);
+            vector<unsigned char> request;
+            PixelBuffer png;
+
+            while (true) {
+                int fd;
+                {
+                    unique_lock<mutex> guard(lock);
+                    has_connection.wait(guard, [this]() { return stop_requested || !ready.empty(); });
+                    if (ready.empty()) return;
+                    fd = ready.front();
+                    ready.pop_front();
+                }
+                bool keep = false;
+                try {
+                    keep = serve_request(engine, fd, request, png);
+                } catch (const exception& e) {
+                    log_line(cerr, string("Dropped a client: ") + e.what());
+                }
+                if (!keep) {
+                    close(fd);
+                    continue;
+                }
+                {
+                    lock_guard<mutex> guard(lock);
+                    returned.push_back(fd);
+                }
+                const unsigned char wake = 1;
+                ssize_t ignored = write(wake_pipe[1], &wake, 1);   // a full pipe means the loop is woken already
+                (void)ignored;
+            }
+        }
+
+    public:
+        AsciiServer(const string& socket_path, const PipelineOptions& options, unsigned thread_count)
+            : socket_path(socket_path), options(options), thread_count(thread_count) {
+            if (this->thread_count == 0) this->thread_count = max(thread::hardware_concurrency(), 1u);
+        }
+
+        string stats() {
+            lock_guard<mutex> guard(lock);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            char report[256];
+            snprintf(report, sizeof(report), "requests %llu\nfailed %llu\nrequests/s %.1f\np50 %.3f ms\np99 %.3f ms\n",
+                     (unsigned long long)latencies.count(), (unsigned long long)failed,
+                     seconds > 0 ? latencies.count() / seconds : 0.0,
+                     latencies.percentile(0.50) / 1000, latencies.percentile(0.99) / 1000);
+            return report;
+        }
+
+        // serves until SIGINT or SIGTERM, then prints the statistics
+        void run() {
+            sockaddr_un address = socket_address(socket_path);
+            listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listen_fd < 0) throw runtime_error(string("Failed to create the socket: ") + strerror(errno));
+            unlink(socket_path.c_str());   // left over from a server that did not shut down cleanly
+            if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+                close(listen_fd);
+                throw runtime_error("Failed to listen on " + socket_path + ": " + strerror(errno));
+            }
+
+            signal(SIGPIPE, SIG_IGN);   // a client that goes away is an error on write, not a crash
+            signal(SIGINT, request_stop);
+            signal(SIGTERM, request_stop);
+
+            if (pipe(wake_pipe) != 0) {
+                close(listen_fd);
+                throw runtime_error(string("Failed to create the wake pipe: ") + strerror(errno));
+            }
+            fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+            started = chrono::steady_clock::now();
+            vector<thread> workers;
+            for (unsigned i = 0; i < thread_count; i++)
+                workers.emplace_back([this]() { worker_loop(); });
+            log_line(cout, "Listening on " + socket_path + " with " + to_string(thread_count) + " workers");
+
+            // every idle connection is watched here, so they never hold a worker
+            vector<int> idle;
+            vector<pollfd> watch;
+            while (!stop_requested) {
+                watch.assign({ { listen_fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } });
+                for (int fd : idle) watch.push_back({ fd, POLLIN, 0 });
+                int count = poll(watch.data(), watch.size(), 200);
+                if (count < 0 && errno != EINTR) break;
+                if (count <= 0) continue;
+
+                vector<int> still_idle;
+                {
+                    lock_guard<mutex> guard(lock);
+                    for (size_t i = 2; i < watch.size(); i++) {
+                        if (watch[i].revents) {   // a request, or a hang up that its worker will see
+                            ready.push_back(watch[i].fd);
+                            has_connection.notify_one();
+                        } else
+                            still_idle.push_back(watch[i].fd);
+                    }
+                    if (watch[1].revents) {
+                        unsigned char drain[64];
+                        while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+                        still_idle.insert(still_idle.end(), returned.begin(), returned.end());
+                        returned.clear();
+                    }
+                }
+                idle.swap(still_idle);
+                if (watch[0].revents) {
+                    int fd = accept(listen_fd, nullptr, nullptr);
+                    if (fd >= 0) idle.push_back(fd);
+                }
+            }
+
+            {
+                lock_guard<mutex> guard(lock);
+                has_connection.notify_all();
+            }
+            for (thread& worker : workers) worker.join();
+            for (int fd : idle) close(fd);
+            for (int fd : ready) close(fd);
+            for (int fd : returned) close(fd);
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+            close(listen_fd);
+            unlink(socket_path.c_str());
+            string report = stats();
+            report.pop_back();   // log_line ends the line
+            log_line(cout, report);
+        }
+};
+
+}
+
+void run_server(const string& socket_path, const PipelineOptions& options, unsigned thread_count) {
+    AsciiServer(socket_path, options, thread_count).run();
+}
+
+// Stub client: sends img_path repeat times over one connection and prints the last text
+// frame. With png_path the grid comes back as a png too, with stats_only the server's
+// statistics are printed instead
+void run_client(const string& socket_path, const string& img_path, const PipelineOptions& options,
+                const string& png_path, unsigned repeat, bool stats_only) {
+    int fd = connect_socket(socket_path);
+    try {
+        unique_ptr<MappedFile> input;
+        RequestHeader header = { request_magic, WANT_STATS, 0, 0, 0 };
+        if (!stats_only) {
+            input = make_unique<MappedFile>(img_path);
+            header.flags = WANT_TEXT | (png_path.empty() ? 0u : (uint32_t)WANT_PNG);
+            header.scale_milli = options.grid_scale != 1.0f ? (uint32_t)lround(options.grid_scale * 1000) : 0;
+            header.palette_size = options.palette.size();
+            header.image_size = input->size();
+        }
+
+        vector<unsigned char> text, png;
+        auto begin = chrono::steady_clock::now();
+        for (unsigned i = 0; i < max(repeat, 1u); i++) {
+            write_all(fd, reinterpret_cast<const unsigned char*>(&header), sizeof(header));
+            write_all(fd, reinterpret_cast<const unsigned char*>(options.palette.data()), header.palette_size);
+            if (input) write_all(fd, input->data(), header.image_size);
+
+            ResponseHeader response;
+            if (!read_all(fd, reinterpret_cast<unsigned char*>(&response), sizeof(response)))
+                throw runtime_error("The server closed the connection");
+            text.resize(response.text_size);
+            png.resize(response.png_size);
+            if (!text.empty()) read_all(fd, text.data(), text.size());
+            if (!png.empty()) read_all(fd, png.data(), png.size());
+            if (response.status != 0) throw runtime_error("Server: " + string(text.begin(), text.end()));
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+        write_all(STDOUT_FILENO, text.data(), text.size());
+        if (!png.empty()) write_file(png_path, png.data(), png.size());
+        if (repeat > 1) {
+            char report[128];
+            snprintf(report, sizeof(report), "%u requests in %.3f s, %.1f requests/s", repeat, seconds, repeat / seconds);
+            log_line(cerr, report);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+ToAscii::ToAscii(const PipelineOptions& options) : engine(make_unique<Engine>(options)) {}
+ToAscii::~ToAscii() = default;
+ToAscii::ToAscii(ToAscii&&) noexcept = default;
+ToAscii& ToAscii::operator=(ToAscii&&) noexcept = default;
+
+void ToAscii::ascii_pipeline(string img_path) { engine->ascii_pipeline(img_path); }
+void ToAscii::batch_ascii(string folder_path, unsigned thread_count) { engine->batch_ascii(folder_path, thread_count); }
+void ToAscii::stream_pipeline(int in_fd, int out_fd) { engine->stream_pipeline(in_fd, out_fd); }
+void ToAscii::video_pipeline(int in_fd, int out_fd, int frame_width, int frame_height, int channels, bool timings) {
+    engine->video_pipeline(in_fd, out_fd, frame_width, frame_height, channels, timings);
+}
+void ToAscii::benchmark(unsigned iterations) { engine->benchmark(iterations); }
+
+namespace {
+
+// the engine of the calling thread, set up for options
+ToAscii::Engine& thread_engine(const PipelineOptions& options) {
+    thread_local unique_ptr<ToAscii::Engine> engine;
+    if (!engine) {
+        PipelineOptions engine_options = options;
+        engine_options.png = PngMode::Off;   // nothing is ever written to a file
+        engine = make_unique<ToAscii::Engine>(engine_options);
+    }
+    engine->apply(options);
+    return *engine;
+}
+
+}
+
+size_t ascii_convert(const unsigned char* image, size_t image_size, const PipelineOptions& options,
+                     unsigned char* out, size_t capacity) {
+    const vector<unsigned char>& frame = thread_engine(options).convert_memory(image, image_size);
+    if (frame.size() <= capacity)
+        memcpy(out, frame.data(), frame.size());
+    return frame.size();
+}
+
+size_t ascii_frame_capacity(const unsigned char* image, size_t image_size, const PipelineOptions& options) {
+    return thread_engine(options).frame_capacity(image, image_size);
+}
@@ -0,0 +1,108 @@
+#ifndef TO_ASCII_H
+#define TO_ASCII_H
+
+// The converter as a library. Build to_ascii.cpp (it also holds the stb_image
+// implementation) with the program, for example
+//     g++ -std=c++17 -O2 main.cpp to_ascii.cpp -o ascii_converter -pthread
+//
+// ascii_convert is the embedding API: image bytes in, text frame out, no files touched.
+// ToAscii runs the command line pipelines (files, folders, streams, video, benchmark).
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Deflate backends for the PNG writer. stb_image_write has a single compress hook,
+// so the choice is process wide and made once at startup with set_png_backend.
+enum class PngBackend { Builtin, Store, Fast, Zlib, Libdeflate };
+
+enum class PngMode { Off, Sync, Async };
+
+enum class ColorMode { Off, TrueColor, Palette256 };
+
+// How a cell picks its glyph: by mean brightness, by the shape of its 4x8 sub-block, or as
+// the Unicode quadrant block (2x2) or braille pattern (2x4) of its thresholded samples
+enum class GlyphMode { Brightness, Structure, Quadrant, Braille };
+
+// Dithering between the resize and the glyph choice, against banding on gradients
+enum class DitherMode { Off, FloydSteinberg, Atkinson, Bayer };
+
+class Tracer;
+
+struct PipelineOptions {
+    PngMode png = PngMode::Sync;   // the intermediate out/*.png, most consumers only want the text
+    PngBackend png_backend = PngBackend::Builtin;   // applied process wide by main
+    bool cache = false;   // batch only: skip inputs whose outputs are already up to date
+    std::string palette;   // empty for the built in one
+    float grid_scale = 1.0f;   // multiplies the characters per pixel in both directions
+    int columns = 0;   // fit the output in this many characters per row, 0 for no limit
+    int rows = 0;   // and in this many rows. Either one replaces the fixed ratios and grid_scale
+    float char_aspect = 2.0f;   // character cell height / width, keeps --cols output undistorted
+    ColorMode color = ColorMode::Off;   // ANSI colored glyphs, decodes RGB instead of gray
+    GlyphMode glyph_mode = GlyphMode::Brightness;   // Structure: palette empty for the whole glyph font
+    DitherMode dither = DitherMode::Off;   // not with GlyphMode::Structure
+    bool animate = false;   // GIFs become a frame stream instead of their first frame, text only: no png
+    unsigned frame_threads = 1;   // animation workers and dither wavefront, 0 for one per hardware thread
+    Tracer* tracer = nullptr;   // --trace, shared by every engine, owned by main
+};
+
+bool png_backend_available(PngBackend backend);
+void set_png_backend(PngBackend backend);   // throws when the backend is not built in
+
+// Encoded image (anything stb_image reads) -> text frame, newline after every row.
+// The frame is written to out only when it fits in capacity; the return value is its
+// size either way, so a result above capacity means nothing was written. Uses the
+// palette, grid size, glyph mode, dither and color of options. Thread safe and
+// re-entrant: every calling thread converts on an engine of its own. Throws
+// std::runtime_error on a bad image.
+size_t ascii_convert(const unsigned char* image, size_t image_size, const PipelineOptions& options,
+                     unsigned char* out, size_t capacity);
+
+// Enough capacity for ascii_convert of this image, from its header alone. Exact for gray
+// output other than quadrants
+size_t ascii_frame_capacity(const unsigned char* image, size_t image_size, const PipelineOptions& options);
+
+// Per-stage timing shared by every engine through PipelineOptions::tracer
+class Tracer {
+    public:
+        Tracer();
+        ~Tracer();
+        Tracer(const Tracer&) = delete;
+        Tracer& operator=(const Tracer&) = delete;
+
+        std::string summary();   // one row per stage: count, total, p50/p99, MB, MB/s
+        void write_chrome_trace(const std::string& path);   // chrome://tracing and Perfetto load it
+
+        class Log;
+        std::unique_ptr<Log> log;   // spans and per stage totals, see to_ascii.cpp
+};
+
+// The command line pipelines. Every method throws std::runtime_error on failure
+class ToAscii {
+    public:
+        explicit ToAscii(const PipelineOptions& options = {});
+        ~ToAscii();
+        ToAscii(ToAscii&&) noexcept;
+        ToAscii& operator=(ToAscii&&) noexcept;
+
+        void ascii_pipeline(std::string img_path);   // -> ascii/<name> and out/<name>.png
+        void batch_ascii(std::string folder_path, unsigned thread_count = 0);   // 0 threads: one per core
+        void stream_pipeline(int in_fd, int out_fd);   // one image in, its frame out
+        // raw frames of width x height with 1 (gray8) or 3 (RGB24) channels, until in_fd ends
+        void video_pipeline(int in_fd, int out_fd, int frame_width, int frame_height, int channels, bool timings);
+        void benchmark(unsigned iterations);   // JSON on stdout
+
+        class Engine;
+
+    private:
+        std::unique_ptr<Engine> engine;
+};
+
+// Unix domain socket server with warm engines, runs until SIGINT or SIGTERM
+void run_server(const std::string& socket_path, const PipelineOptions& options, unsigned thread_count);
+
+// Stub client for run_server: prints the text frame of img_path, or the server statistics
+void run_client(const std::string& socket_path, const std::string& img_path, const PipelineOptions& options,
+                const std::string& png_path, unsigned repeat, bool stats_only);
+
+#endif